@@ -5,10 +5,41 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+#include <list>
+#include <chrono>
+#include <functional>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <cstdlib>
+#ifdef _WIN32
+#include <io.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 using namespace std;
 
 const int WINW = 800;
 const int WINH = 600;
+const int MAX_CANVAS = 65536;
+const int TILE = 256;
 
 // Herramientas disponibles
 enum Tool {
@@ -16,27 +47,205 @@ enum Tool {
     LINE_DDA,
     CIRCLE_PM,
     ELLIPSE_PM,
+    FILL_SCAN,
+    BEZIER_AFD,
+    LINE_DDA_FIXED,
+    SELECT,
     NONE
 };
 
+inline bool isLine(Tool t) {
+    return t == LINE_DIRECT || t == LINE_DDA || t == LINE_DDA_FIXED;
+}
+
 // Estructura de color
 struct Color {
     float r, g, b;
 };
 
+// Tramo horizontal de pixeles: fila, inicio y longitud
+struct Span {
+    int y, x, len;
+};
+
+struct Point {
+    int x, y;
+};
+
+// Desplazamientos de las copias de una figura repetida
+typedef shared_ptr<const vector<Point>> Offsets;
+
 // Estructura para una figura
 struct Shape {
     Tool type;
-    int x1, y1, x2, y2;   // para lineas
+    int x1, y1, x2, y2;   // para lineas (x1, y1 = semilla del relleno)
     int xc, yc, r;        // para circulo
     int rx, ry;           // para elipse
+    int cx1, cy1, cx2, cy2;   // puntos de control de la Bezier (de x1, y1 a x2, y2)
     Color color;
     int thickness;
+    shared_ptr<const vector<Span>> spans;   // tramos calculados del relleno
+    Offsets offsets;      // NULL: una sola copia; si no, una por desplazamiento
+    unsigned int id;      // identificador unico (no se guarda en el diario)
+    int layer;            // indice en layers
+};
+
+struct LayerRaster;
+
+// Capa: figuras con nombre que se componen en orden. Cada capa guarda su
+// raster ya generado en una display list; ocultar, mostrar o reordenar
+// solo vuelve a componer, no rasteriza de nuevo.
+struct Layer {
+    string name;
+    bool visible = true;
+    GLuint list = 0;      // 0 si aun no se genero
+    shared_ptr<const LayerRaster> built;   // raster con el que se armo la lista
+    vector<GLuint> stamps;   // listas de las figuras repetidas de built
+};
+
+Layer namedLayer(const string &name) {
+    Layer L;
+    L.name = name;
+    return L;
+}
+
+vector<Layer> layers = {namedLayer("Capa 1")};
+vector<int> layerOrder = {0};   // de abajo hacia arriba
+int currentLayer = 0;
+
+// El diario guarda la capa de cada figura en un byte
+const int MAX_LAYERS = 255;
+
+void ensureLayer(int i) {
+    while ((int) layers.size() <= i) {
+        layers.push_back(namedLayer("Capa " + to_string(layers.size() + 1)));
+        layerOrder.push_back((int) layers.size() - 1);
+    }
+}
+
+// ---------------- Lista persistente de figuras ----------------
+// Vector inmutable con estructura compartida: arbol de 32 hijos por nodo
+// mas una cola con las ultimas figuras. Copiar la lista es O(1), asi que la
+// escena publicada, las pilas de deshacer y el snapshot del diario
+// comparten los bloques en lugar de copiar todas las figuras. Agregar
+// copia la cola y, cada 32 figuras, el camino hasta la hoja nueva; si la
+// cola no esta compartida se agrega en el lugar.
+struct ShapeList {
+    static const int BITS = 5;
+    static const size_t WIDTH = (size_t) 1 << BITS;
+
+    struct Node {
+        vector<shared_ptr<const Node>> kids;   // nodo interno
+        vector<Shape> items;                   // hoja, siempre llena
+    };
+    typedef shared_ptr<const Node> NodePtr;
+
+    NodePtr root;                      // NULL hasta que se llena la primera hoja
+    shared_ptr<vector<Shape>> tail;    // solo se modifica si nadie mas la usa
+    size_t n = 0;
+    int shift = BITS;
+
+    struct const_iterator {
+        const ShapeList *l;
+        size_t i;
+        const Shape *p;
+
+        const Shape &operator*() const { return *p; }
+        const Shape *operator->() const { return p; }
+        bool operator!=(const const_iterator &o) const { return i != o.i; }
+        bool operator==(const const_iterator &o) const { return i == o.i; }
+
+        const_iterator &operator++() {
+            ++i;
+            ++p;
+            if ((i & (WIDTH - 1)) == 0 && i < l->n) p = l->leafFor(i);
+            return *this;
+        }
+    };
+
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    void clear() { *this = ShapeList(); }
+
+    const_iterator begin() const { return {this, 0, n ? leafFor(0) : NULL}; }
+    const_iterator end() const { return {this, n, NULL}; }
+
+    const Shape &operator[](size_t i) const { return leafFor(i)[i & (WIDTH - 1)]; }
+    const Shape &back() const { return (*this)[n - 1]; }
+
+    size_t tailOffset() const {
+        return n < WIDTH ? 0 : ((n - 1) >> BITS) << BITS;
+    }
+
+    // Primer elemento del bloque de WIDTH figuras que contiene a i
+    const Shape *leafFor(size_t i) const {
+        if (i >= tailOffset()) return tail->data();
+        const Node *p = root.get();
+        for (int level = shift; level > 0; level -= BITS) p = p->kids[(i >> level) & (WIDTH - 1)].get();
+        return p->items.data();
+    }
+
+    void push_back(const Shape &s) {
+        if (tail && n - tailOffset() < WIDTH) {
+            if (tail.use_count() > 1) tail = make_shared<vector<Shape>>(*tail);
+            else atomic_thread_fence(memory_order_acquire);   // los demas ya la soltaron
+            tail->push_back(s);
+            n++;
+            return;
+        }
+
+        // Cola llena: pasa al arbol como hoja y se empieza otra
+        if (tail) {
+            auto leaf = make_shared<Node>();
+            leaf->items = *tail;
+            if (!root) {
+                auto r = make_shared<Node>();
+                r->kids.push_back(leaf);
+                root = r;
+            }
+            else if ((n >> BITS) > ((size_t) 1 << shift)) {
+                auto r = make_shared<Node>();
+                r->kids.push_back(root);
+                r->kids.push_back(newPath(shift, leaf));
+                root = r;
+                shift += BITS;
+            }
+            else {
+                root = pushTail(shift, root, leaf);
+            }
+        }
+        tail = make_shared<vector<Shape>>();
+        tail->reserve(WIDTH);
+        tail->push_back(s);
+        n++;
+    }
+
+    static NodePtr newPath(int level, const NodePtr &leaf) {
+        if (level == 0) return leaf;
+        auto r = make_shared<Node>();
+        r->kids.push_back(newPath(level - BITS, leaf));
+        return r;
+    }
+
+    // Copia el camino desde parent hasta donde va la hoja nueva
+    NodePtr pushTail(int level, const NodePtr &parent, const NodePtr &leaf) const {
+        auto p = make_shared<Node>(*parent);
+        size_t sub = ((n - 1) >> level) & (WIDTH - 1);
+        NodePtr ins;
+        if (level == BITS) ins = leaf;
+        else if (sub < p->kids.size()) ins = pushTail(level - BITS, p->kids[sub], leaf);
+        else ins = newPath(level - BITS, leaf);
+
+        if (sub < p->kids.size()) p->kids[sub] = ins;
+        else p->kids.push_back(ins);
+        return p;
+    }
 };
 
-vector<Shape> shapes;
-stack<vector<Shape>> undo_stack;
-stack<vector<Shape>> redo_stack;
+ShapeList shapes;
+stack<ShapeList> undo_stack;
+stack<ShapeList> redo_stack;
+int maxShapeLayer = 0;    // capa mas alta usada; solo crece, como layers
 
 // Estado actual
 Tool currentTool = LINE_DIRECT;
@@ -45,54 +254,762 @@ int currentThickness = 1;
 bool showGrid = true;
 bool showAxes = true;
 bool waitingSecondPoint = false;
+unsigned int nextShapeId = 0;
+unsigned int selectedId = 0;
+size_t selectedIndex = 0;
 int firstX = 0;
 int firstY = 0;
+int bezierCount = 0;      // clics ya dados para la Bezier actual
+int bezierX[3], bezierY[3];
 int viewportW = WINW;
 int viewportH = WINH;
 
+// Lienzo logico: por defecto sigue al tamano de la ventana,
+// con --canvas WxH queda fijo y la vista se desplaza con las flechas
+int canvasW = WINW;
+int canvasH = WINH;
+bool canvasFixed = false;
+int viewX = 0;
+int viewY = 0;
+
 inline int roundi(float v) {
     return (int) floor(v + 0.5f);
 }
 
-// Manejo de pilas undo/redo
+inline unsigned char toByte(float v) {
+    return (unsigned char) roundi(v * 255);
+}
+
+// ---------------- Repeticiones ----------------
+// Una figura repetida guarda su geometria una vez y la lista de
+// desplazamientos; se rasteriza una vez y se estampa en cada copia.
+// Las listas se comparten entre todas las figuras que las usan. Quien las
+// pide valida que (n - 1) * paso entre en int (el servidor lo acota a
+// SERVER_COORD).
+Offsets gridOffsets(int nx, int ny, int sx, int sy) {
+    auto v = make_shared<vector<Point>>();
+    v->reserve((size_t) nx * ny);
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) v->push_back({i * sx, j * sy});
+    }
+    return v;
+}
+
+// n copias repartidas sobre un circulo de radio r alrededor de la figura
+Offsets ringOffsets(int n, int r) {
+    auto v = make_shared<vector<Point>>();
+    for (int i = 0; i < n; i++) {
+        double a = 2 * M_PI * i / n;
+        v->push_back({roundi(r * cos(a)), roundi(r * sin(a))});
+    }
+    return v;
+}
+
+const int MAX_COPIES = 1 << 20;
+
+// Repeticion que se aplica a las figuras dibujadas con el mouse
+Offsets currentRepeat;
+
+// Llama f(dx, dy) por cada copia de la figura
+template <class F>
+void forInstances(const Shape &s, F f) {
+    if (!s.offsets) {
+        f(0, 0);
+        return;
+    }
+    for (const Point &o : *s.offsets) f(o.x, o.y);
+}
+
+// ---------------- Indice espacial ----------------
+struct Box {
+    int x0, y0, x1, y1;
+};
+
+// Caja de una sola copia
+Box baseBox(const Shape &s) {
+    Box b;
+    if (isLine(s.type)) {
+        b = {min(s.x1, s.x2), min(s.y1, s.y2), max(s.x1, s.x2), max(s.y1, s.y2)};
+    }
+    else if (s.type == CIRCLE_PM) {
+        b = {s.xc - s.r, s.yc - s.r, s.xc + s.r, s.yc + s.r};
+    }
+    else if (s.type == ELLIPSE_PM) {
+        b = {s.xc - s.rx, s.yc - s.ry, s.xc + s.rx, s.yc + s.ry};
+    }
+    else if (s.type == BEZIER_AFD) {
+        // La curva queda dentro de la envolvente de sus puntos de control
+        b = {min(min(s.x1, s.x2), min(s.cx1, s.cx2)), min(min(s.y1, s.y2), min(s.cy1, s.cy2)),
+             max(max(s.x1, s.x2), max(s.cx1, s.cx2)), max(max(s.y1, s.y2), max(s.cy1, s.cy2))};
+    }
+    else if (s.type == FILL_SCAN && s.spans && !s.spans->empty()) {
+        b = {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+        for (const Span &sp : *s.spans) {
+            b.x0 = min(b.x0, sp.x);
+            b.x1 = max(b.x1, sp.x + sp.len - 1);
+            b.y0 = min(b.y0, sp.y);
+            b.y1 = max(b.y1, sp.y);
+        }
+        return b;
+    }
+    else {
+        return {s.x1, s.y1, s.x1, s.y1};
+    }
+
+    int t = s.thickness / 2 + 1;
+    return {b.x0 - t, b.y0 - t, b.x1 + t, b.y1 + t};
+}
+
+// Caja de todas las copias
+Box shapeBox(const Shape &s) {
+    Box b = baseBox(s);
+    if (!s.offsets || s.offsets->empty()) return b;
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+    for (const Point &o : *s.offsets) {
+        x0 = min(x0, o.x);
+        y0 = min(y0, o.y);
+        x1 = max(x1, o.x);
+        y1 = max(y1, o.y);
+    }
+    return {b.x0 + x0, b.y0 + y0, b.x1 + x1, b.y1 + y1};
+}
+
+// Distancia exacta del punto (px, py) al segmento (x0, y0)-(x1, y1)
+double distToSegment(double px, double py, double x0, double y0, double x1, double y1) {
+    double dx = x1 - x0;
+    double dy = y1 - y0;
+    double l2 = dx * dx + dy * dy;
+    double u = l2 > 0 ? ((px - x0) * dx + (py - y0) * dy) / l2 : 0;
+    u = max(0.0, min(1.0, u));
+    return hypot(px - (x0 + u * dx), py - (y0 + u * dy));
+}
+
+// Distancia exacta del punto (x, y) a la elipse de semiejes a y b centrada
+// en el origen (Eberly). Por simetria se trabaja en el primer cuadrante con
+// a >= b; el punto mas cercano sale de la raiz s de
+// (a x / (s + a^2))^2 + (b y / (s + b^2))^2 = 1, que se busca por
+// biseccion (escalada por b^2) hasta que el intervalo no se puede partir.
+double distToEllipse(double a, double b, double x, double y) {
+    x = fabs(x);
+    y = fabs(y);
+    if (a < b) {
+        swap(a, b);
+        swap(x, y);
+    }
+    if (y == 0) {
+        // Sobre el eje mayor: el punto mas cercano puede estar fuera del eje
+        double n0 = a * x, d0 = a * a - b * b;
+        if (n0 >= d0) return fabs(x - a);
+        double t = n0 / d0;
+        return hypot(a * t - x, b * sqrt(1 - t * t));
+    }
+    if (x == 0) return fabs(y - b);
+
+    double z0 = x / a, z1 = y / b;
+    double g = z0 * z0 + z1 * z1 - 1;
+    if (g == 0) return 0;
+    double r0 = (a / b) * (a / b);
+    double n0 = r0 * z0;
+    double s0 = z1 - 1;
+    double s1 = g < 0 ? 0 : hypot(n0, z1) - 1;
+    double s = 0;
+    for (int i = 0; i < 1100; i++) {
+        s = (s0 + s1) / 2;
+        if (s == s0 || s == s1) break;
+        double q0 = n0 / (s + r0), q1 = z1 / (s + 1);
+        g = q0 * q0 + q1 * q1 - 1;
+        if (g > 0) s0 = s;
+        else if (g < 0) s1 = s;
+        else break;
+    }
+    return hypot(r0 * x / (s + r0) - x, y / (s + 1) - y);
+}
+
+// Distancia del punto al trazo de la figura: exacta en lineas, circulos y
+// elipses, aproximada en curvas (poligonal de 32 tramos)
+double baseDistance(const Shape &s, int px, int py) {
+    double d = 0;
+    if (isLine(s.type)) {
+        d = distToSegment(px, py, s.x1, s.y1, s.x2, s.y2);
+    }
+    else if (s.type == CIRCLE_PM) {
+        d = fabs(hypot(px - s.xc, py - s.yc) - s.r);
+    }
+    else if (s.type == ELLIPSE_PM) {
+        double dx = px - s.xc;
+        double dy = py - s.yc;
+        if (s.rx == 0 || s.ry == 0) {
+            d = distToSegment(px, py, s.xc - s.rx, s.yc - s.ry, s.xc + s.rx, s.yc + s.ry);
+        }
+        else {
+            d = distToEllipse(s.rx, s.ry, dx, dy);
+        }
+    }
+    else if (s.type == BEZIER_AFD) {
+        // Poligonal de 32 segmentos sobre la curva
+        double qx = s.x1, qy = s.y1;
+        d = 1e9;
+        for (int i = 1; i <= 32; i++) {
+            double t = i / 32.0, u = 1 - t;
+            double nx = u * u * u * s.x1 + 3 * u * u * t * s.cx1 + 3 * u * t * t * s.cx2 + t * t * t * s.x2;
+            double ny = u * u * u * s.y1 + 3 * u * u * t * s.cy1 + 3 * u * t * t * s.cy2 + t * t * t * s.y2;
+            d = min(d, distToSegment(px, py, qx, qy, nx, ny));
+            qx = nx;
+            qy = ny;
+        }
+    }
+    else if (s.type == FILL_SCAN) {
+        if (s.spans) {
+            for (const Span &sp : *s.spans) {
+                if (sp.y == py && px >= sp.x && px < sp.x + sp.len) return 0;
+            }
+        }
+        return 1e9;
+    }
+    return max(0.0, d - s.thickness / 2.0);
+}
+
+// Distancia a la copia mas cercana
+double shapeDistance(const Shape &s, int px, int py) {
+    double d = 1e9;
+    forInstances(s, [&](int dx, int dy) { d = min(d, baseDistance(s, px - dx, py - dy)); });
+    return d;
+}
+
+// Las escenas solo crecen por el final o se reemplazan con undo/redo.
+// Una figura con el mismo id en la misma posicion implica el mismo
+// prefijo, asi que el prefijo comun se busca por biseccion.
+template <class Same>
+size_t commonPrefix(size_t na, size_t nb, Same same) {
+    size_t lo = 0, hi = min(na, nb);
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (same(mid - 1)) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Grilla uniforme por niveles: una figura va al nivel cuya celda
+// (64 << nivel) es al menos tan grande como su caja, asi ocupa como
+// maximo 2 x 2 celdas y el tamano de la figura no importa.
+const int GRID_SHIFT = 6;
+const int GRID_LEVELS = 26;
+
+struct SpatialIndex {
+    struct Entry {
+        Box box;
+        int level;
+    };
+
+    unordered_map<long long, vector<int>> cells;
+    vector<unsigned int> ids;     // ids de las figuras indexadas, en orden
+    vector<Entry> entries;
+    int levelCount[GRID_LEVELS] = {0};
+
+    static long long key(int level, long long cx, long long cy) {
+        return ((long long) level << 58) | ((cx & 0x1FFFFFFF) << 29) | (cy & 0x1FFFFFFF);
+    }
+
+    template <class F>
+    static void forCells(const Box &b, int level, F f) {
+        int sh = GRID_SHIFT + level;
+        for (long long cy = (long long) b.y0 >> sh; cy <= ((long long) b.y1 >> sh); cy++) {
+            for (long long cx = (long long) b.x0 >> sh; cx <= ((long long) b.x1 >> sh); cx++) {
+                f(key(level, cx, cy));
+            }
+        }
+    }
+
+    void clear() {
+        cells.clear();
+        ids.clear();
+        entries.clear();
+        for (int &c : levelCount) c = 0;
+    }
+
+    void push(const Shape &s) {
+        Box b = shapeBox(s);
+        long long size = max((long long) b.x1 - b.x0, (long long) b.y1 - b.y0);
+        int level = 0;
+        while (level < GRID_LEVELS - 1 && ((long long) 1 << (GRID_SHIFT + level)) < size) level++;
+
+        int idx = (int) ids.size();
+        ids.push_back(s.id);
+        entries.push_back({b, level});
+        levelCount[level]++;
+        forCells(b, level, [&](long long k) { cells[k].push_back(idx); });
+    }
+
+    void pop() {
+        int idx = (int) ids.size() - 1;
+        Entry &e = entries.back();
+        forCells(e.box, e.level, [&](long long k) {
+            vector<int> &c = cells[k];
+            c.erase(find(c.begin(), c.end(), idx));
+            if (c.empty()) cells.erase(k);
+        });
+        levelCount[e.level]--;
+        ids.pop_back();
+        entries.pop_back();
+    }
+
+    void sync(const ShapeList &v) {
+        size_t lo = commonPrefix(ids.size(), v.size(),
+                                 [&](size_t i) { return ids[i] == v[i].id; });
+
+        if (lo == 0) clear();
+        while (ids.size() > lo) pop();
+        for (size_t i = lo; i < v.size(); i++) push(v[i]);
+    }
+
+    // Figura mas cercana a (px, py) a no mas de tol pixeles, solo en las
+    // capas visibles; -1 si no hay
+    int nearest(const ShapeList &v, int px, int py, int tol, const vector<char> &visible) const {
+        Box q = {px - tol, py - tol, px + tol, py + tol};
+        int best = -1;
+        double bestD = tol + 0.5;
+
+        for (int level = 0; level < GRID_LEVELS; level++) {
+            if (!levelCount[level]) continue;
+            forCells(q, level, [&](long long k) {
+                auto it = cells.find(k);
+                if (it == cells.end()) return;
+                for (int i : it->second) {
+                    int li = v[i].layer;
+                    if (li < (int) visible.size() && !visible[li]) continue;
+                    const Box &b = entries[i].box;
+                    if (q.x1 < b.x0 || q.x0 > b.x1 || q.y1 < b.y0 || q.y0 > b.y1) continue;
+                    double d = shapeDistance(v[i], px, py);
+                    if (d < bestD || (d == bestD && i > best)) {
+                        bestD = d;
+                        best = i;
+                    }
+                }
+            });
+        }
+        return best;
+    }
+};
+
+SpatialIndex shapeIndex;
+
+// ---------------- Diario (autosave) ----------------
+// Cada cambio de la escena se agrega al final de canvas.journal como un
+// registro binario corto. Al iniciar se carga canvas.snap y se repiten los
+// registros; la compactacion junta todo en un nuevo snapshot.
+const char *JOURNAL_FILE = "canvas.journal";
+const char *JOURNAL_OLD_FILE = "canvas.journal.old";
+const char *SNAP_FILE = "canvas.snap";
+const char *SNAP_TMP_FILE = "canvas.snap.tmp";
+const long COMPACT_BYTES = 1 << 20;
+
+// Los dos archivos empiezan con "CADJ" o "CADS", este byte y la
+// generacion; un formato distinto no se lee
+const int JOURNAL_VERSION = 1;
+
+enum JournalOp {
+    J_ADD = 1,
+    J_CLEAR = 2,
+    J_UNDO = 3,
+    J_REDO = 4,
+    J_BATCH = 5           // varias figuras con una sola entrada de deshacer
+};
+
+// Bit alto del tipo: la figura trae su lista de desplazamientos al final
+const int SHAPE_REPEATED = 0x80;
+
+bool journalEnabled = true;
+bool journalReplaying = false;
+bool journalDirty = false;
+FILE *journalFile = NULL;
+unsigned int journalGen = 0;   // generacion del snapshot sobre el que se aplica
+
+// Escritura de enteros con longitud variable (zigzag + varint)
+struct ByteWriter {
+    vector<unsigned char> b;
+
+    void u8(int v) { b.push_back((unsigned char) v); }
+    void u32(unsigned int v) { for (int i = 0; i < 4; i++) u8((v >> (8 * i)) & 255); }
+    void var(long long v) {
+        unsigned long long z = ((unsigned long long) v << 1) ^ (unsigned long long) (v >> 63);
+        while (z >= 128) {
+            u8((int) (z & 127) | 128);
+            z >>= 7;
+        }
+        u8((int) z);
+    }
+};
+
+struct ByteReader {
+    const unsigned char *p, *e;
+    bool ok = true;
+
+    int u8() {
+        if (p >= e) { ok = false; return 0; }
+        return *p++;
+    }
+    unsigned int u32() {
+        unsigned int v = 0;
+        for (int i = 0; i < 4; i++) v |= (unsigned int) u8() << (8 * i);
+        return v;
+    }
+    long long var() {
+        unsigned long long z = 0;
+        for (int sh = 0; sh < 64; sh += 7) {
+            int c = u8();
+            z |= (unsigned long long) (c & 127) << sh;
+            if (!(c & 128)) break;
+        }
+        return (long long) (z >> 1) ^ -(long long) (z & 1);
+    }
+};
+
+void putShape(ByteWriter &w, const Shape &s) {
+    w.u8(s.type | (s.offsets ? SHAPE_REPEATED : 0));
+    w.u8(toByte(s.color.r));
+    w.u8(toByte(s.color.g));
+    w.u8(toByte(s.color.b));
+    w.u8(s.thickness);
+    w.u8(s.layer);
+
+    if (isLine(s.type)) {
+        w.var(s.x1); w.var(s.y1); w.var(s.x2); w.var(s.y2);
+    }
+    else if (s.type == CIRCLE_PM) {
+        w.var(s.xc); w.var(s.yc); w.var(s.r);
+    }
+    else if (s.type == ELLIPSE_PM) {
+        w.var(s.xc); w.var(s.yc); w.var(s.rx); w.var(s.ry);
+    }
+    else if (s.type == BEZIER_AFD) {
+        w.var(s.x1); w.var(s.y1); w.var(s.cx1); w.var(s.cy1);
+        w.var(s.cx2); w.var(s.cy2); w.var(s.x2); w.var(s.y2);
+    }
+    else if (s.type == FILL_SCAN) {
+        w.var(s.x1); w.var(s.y1);
+        size_t n = s.spans ? s.spans->size() : 0;
+        w.var(n);
+        int py = 0, px = 0;
+        for (size_t i = 0; i < n; i++) {
+            const Span &sp = (*s.spans)[i];
+            w.var(sp.y - py); w.var(sp.x - px); w.var(sp.len);
+            py = sp.y;
+            px = sp.x;
+        }
+    }
+
+    if (s.offsets) {
+        w.var(s.offsets->size());
+        int px = 0, py = 0;
+        for (const Point &o : *s.offsets) {
+            w.var(o.x - px); w.var(o.y - py);
+            px = o.x;
+            py = o.y;
+        }
+    }
+}
+
+bool getShape(ByteReader &rd, Shape &s) {
+    s = Shape{};
+    int type = rd.u8();
+    s.type = (Tool) (type & ~SHAPE_REPEATED);
+    s.color.r = rd.u8() / 255.0f;
+    s.color.g = rd.u8() / 255.0f;
+    s.color.b = rd.u8() / 255.0f;
+    s.thickness = rd.u8();
+    s.layer = rd.u8();
+    if (s.layer >= MAX_LAYERS) return false;
+    ensureLayer(s.layer);
+
+    if (isLine(s.type)) {
+        s.x1 = rd.var(); s.y1 = rd.var(); s.x2 = rd.var(); s.y2 = rd.var();
+    }
+    else if (s.type == CIRCLE_PM) {
+        s.xc = rd.var(); s.yc = rd.var(); s.r = rd.var();
+    }
+    else if (s.type == ELLIPSE_PM) {
+        s.xc = rd.var(); s.yc = rd.var(); s.rx = rd.var(); s.ry = rd.var();
+    }
+    else if (s.type == BEZIER_AFD) {
+        s.x1 = rd.var(); s.y1 = rd.var(); s.cx1 = rd.var(); s.cy1 = rd.var();
+        s.cx2 = rd.var(); s.cy2 = rd.var(); s.x2 = rd.var(); s.y2 = rd.var();
+    }
+    else if (s.type == FILL_SCAN) {
+        s.x1 = rd.var(); s.y1 = rd.var();
+        long long n = rd.var();
+        if (n < 0 || n > rd.e - rd.p) return false;
+        auto sp = make_shared<vector<Span>>(n);
+        int py = 0, px = 0;
+        for (auto &t : *sp) {
+            t.y = py + rd.var(); t.x = px + rd.var(); t.len = rd.var();
+            py = t.y;
+            px = t.x;
+        }
+        s.spans = sp;
+    }
+    else {
+        return false;
+    }
+
+    if (type & SHAPE_REPEATED) {
+        long long n = rd.var();
+        if (n < 0 || n > rd.e - rd.p) return false;
+        auto v = make_shared<vector<Point>>(n);
+        int px = 0, py = 0;
+        for (auto &o : *v) {
+            o.x = px + rd.var(); o.y = py + rd.var();
+            px = o.x;
+            py = o.y;
+        }
+        s.offsets = v;
+    }
+    s.id = ++nextShapeId;
+    return rd.ok;
+}
+
+FILE *openJournal(const char *name, unsigned int gen) {
+    FILE *f = fopen(name, "wb");
+    if (f) {
+        ByteWriter w;
+        w.u8(JOURNAL_VERSION);
+        w.u32(gen);
+        if (fwrite("CADJ", 1, 4, f) != 4 || fwrite(w.b.data(), 1, w.b.size(), f) != w.b.size()) {
+            fclose(f);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+void journalWrite(const ByteWriter &w) {
+    if (!journalFile || journalReplaying) return;
+    if (fwrite(w.b.data(), 1, w.b.size(), journalFile) != w.b.size()) {
+        cout << "Error escribiendo " << JOURNAL_FILE << ", diario desactivado" << endl;
+        fclose(journalFile);
+        journalFile = NULL;
+        return;
+    }
+    journalDirty = true;
+}
+
+void journalOp(JournalOp op) {
+    ByteWriter w;
+    w.u8(op);
+    journalWrite(w);
+}
+
+void journalAdd(const Shape &s) {
+    ByteWriter w;
+    w.u8(J_ADD);
+    putShape(w, s);
+    journalWrite(w);
+}
+
+void journalBatch(const vector<Shape> &v) {
+    ByteWriter w;
+    w.u8(J_BATCH);
+    w.var(v.size());
+    for (auto &s : v) putShape(w, s);
+    journalWrite(w);
+}
+
+bool syncFile(FILE *f) {
+    if (fflush(f) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// Reemplaza to por from de una vez: tras una caida queda el archivo viejo
+// o el nuevo, nunca ninguno de los dos
+bool replaceFile(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+// Manejo de pilas undo/redo. Cada entrada comparte los bloques con la
+// escena, asi que guardarla es O(1).
 void pushUndo() {
     undo_stack.push(shapes);
     while (!redo_stack.empty()) redo_stack.pop();
 }
 
-void doUndo() {
+bool doUndo() {
     if (!undo_stack.empty()) {
         redo_stack.push(shapes);
         shapes = undo_stack.top();
         undo_stack.pop();
-        glutPostRedisplay();
+        shapeIndex.sync(shapes);
+        journalOp(J_UNDO);
+        return true;
     }
+    return false;
 }
 
-void doRedo() {
+bool doRedo() {
     if (!redo_stack.empty()) {
         undo_stack.push(shapes);
         shapes = redo_stack.top();
         redo_stack.pop();
-        glutPostRedisplay();
+        shapeIndex.sync(shapes);
+        journalOp(J_REDO);
+        return true;
+    }
+    return false;
+}
+
+// Cambios de la escena que pasan por el diario
+void addShape(const Shape &sh) {
+    pushUndo();
+    Shape s = sh;
+    s.id = ++nextShapeId;
+    shapes.push_back(s);
+    shapeIndex.push(s);
+    maxShapeLayer = max(maxShapeLayer, s.layer);
+    journalAdd(sh);
+}
+
+// Agrega un lote de figuras como un solo paso de deshacer
+void addShapes(const vector<Shape> &v) {
+    if (v.empty()) return;
+    pushUndo();
+    for (auto &sh : v) {
+        Shape s = sh;
+        s.id = ++nextShapeId;
+        shapes.push_back(s);
+        shapeIndex.push(s);
+        maxShapeLayer = max(maxShapeLayer, s.layer);
     }
+    journalBatch(v);
 }
 
-// Dibuja un pixel
-void putPixel(int x, int y) {
-    glVertex2i(x, y);
+void clearShapes() {
+    pushUndo();
+    shapes.clear();
+    shapeIndex.clear();
+    journalOp(J_CLEAR);
+}
+
+// ---------------- Buffers del renderer ----------------
+// Reservas de memoria hechas por los buffers del renderer
+size_t poolAllocCount = 0;
+size_t poolAllocBytes = 0;
+
+// Allocator que cuenta cada reserva de los buffers del pool
+template <class T>
+struct CountingAllocator {
+    typedef T value_type;
+
+    CountingAllocator() {}
+    template <class U> CountingAllocator(const CountingAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        poolAllocCount++;
+        poolAllocBytes += n * sizeof(T);
+        return (T*) ::operator new(n * sizeof(T));
+    }
+    void deallocate(T *p, size_t) {
+        ::operator delete(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const CountingAllocator<T> &, const CountingAllocator<U> &) { return true; }
+template <class T, class U>
+bool operator!=(const CountingAllocator<T> &, const CountingAllocator<U> &) { return false; }
+
+// Modo de control (compilar con -DCAD_ALLOC_CHECK, destino Check del
+// proyecto): el operator new global cuenta las reservas de cada hilo y
+// redrawAll termina el programa si un frame en regimen estable reservo
+// memoria. Cubre todo lo que pasa por new, no solo el pool.
+#ifdef CAD_ALLOC_CHECK
+thread_local size_t threadAllocCount = 0;
+
+// Sin inline: GCC ve malloc y free en lugar de new y delete y avisa en falso
+#ifdef __GNUC__
+#define CAD_NOINLINE __attribute__((noinline))
+#else
+#define CAD_NOINLINE
+#endif
+
+CAD_NOINLINE void *operator new(size_t n) {
+    threadAllocCount++;
+    void *p = malloc(n ? n : 1);
+    if (!p) throw bad_alloc();
+    return p;
 }
 
+CAD_NOINLINE void operator delete(void *p) noexcept { free(p); }
+CAD_NOINLINE void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+typedef vector<Point, CountingAllocator<Point>> PointBuf;
+typedef vector<Span, CountingAllocator<Span>> SpanBuf;
+
+// Pila del relleno: tramo [l, r] ya pintado en la fila y - dy
+// que todavia falta explorar en la fila y
+struct SpanSeed {
+    int y, l, r, dy;
+};
+
+// Pool de buffers del renderer. Se reinicia en cada frame y los buffers
+// conservan su capacidad, asi que en regimen estable no hay reservas.
+struct FramePool {
+    vector<PointBuf, CountingAllocator<PointBuf>> points;
+    vector<SpanBuf, CountingAllocator<SpanBuf>> spans;
+    size_t pointsUsed = 0;
+    size_t spansUsed = 0;
+    vector<SpanSeed, CountingAllocator<SpanSeed>> seeds;
+    vector<unsigned char, CountingAllocator<unsigned char>> scratch;
+    vector<unsigned char, CountingAllocator<unsigned char>> line;
+
+    void reset() {
+        pointsUsed = 0;
+        spansUsed = 0;
+    }
+
+    PointBuf &pointBuf() {
+        if (pointsUsed == points.size()) points.emplace_back();
+        PointBuf &b = points[pointsUsed++];
+        b.clear();
+        return b;
+    }
+
+    SpanBuf &spanBuf() {
+        if (spansUsed == spans.size()) spans.emplace_back();
+        SpanBuf &b = spans[spansUsed++];
+        b.clear();
+        return b;
+    }
+
+    unsigned char *scratchBuf(size_t n) {
+        if (scratch.size() < n) scratch.resize(n);
+        return scratch.data();
+    }
+
+    // Fila para los exportadores (aparte de la lectura del framebuffer)
+    unsigned char *lineBuf(size_t n) {
+        if (line.size() < n) line.resize(n);
+        return line.data();
+    }
+};
+
+FramePool framePool;
+
 // ---------------- Algoritmos ----------------
 
 // Linea directa
-void lineDirect(int x0, int y0, int x1, int y1, int t) {
+template <class Sink>
+void lineDirect(int x0, int y0, int x1, int y1, Sink &putPixel) {
     int dx = x1 - x0;
     int dy = y1 - y0;
 
-    glPointSize(t);
-    glBegin(GL_POINTS);
-
     if (dx == 0) {
         int sy = (y1 > y0) ? 1 : -1;
         for (int y = y0; y != y1 + sy; y += sy) {
@@ -113,214 +1030,3284 @@ void lineDirect(int x0, int y0, int x1, int y1, int t) {
                 putPixel(x, roundi(m * (x - x0) + y0));
             }
         }
-        else {
-            int sy = (y1 > y0) ? 1 : -1;
-            float invm = (float) dx / dy;
-            for (int y = y0; y != y1 + sy; y += sy) {
-                putPixel(roundi(invm * (y - y0) + x0), y);
+        else {
+            int sy = (y1 > y0) ? 1 : -1;
+            float invm = (float) dx / dy;
+            for (int y = y0; y != y1 + sy; y += sy) {
+                putPixel(roundi(invm * (y - y0) + x0), y);
+            }
+        }
+    }
+}
+
+// Linea DDA
+template <class Sink>
+void lineDDA(int x0, int y0, int x1, int y1, Sink &putPixel) {
+    int dx = x1 - x0;
+    int dy = y1 - y0;
+    int steps = max(abs(dx), abs(dy));
+    if (steps == 0) {
+        putPixel(x0, y0);
+        return;
+    }
+
+    float x = x0;
+    float y = y0;
+    float incx = dx / (float) steps;
+    float incy = dy / (float) steps;
+
+    for (int i = 0; i <= steps; i++) {
+        putPixel(roundi(x), roundi(y));
+        x += incx;
+        y += incy;
+    }
+}
+
+// Linea DDA en punto fijo sin flotantes: cada coordenada se lleva como
+// parte entera mas un resto en [0, 2 * pasos), es decir con denominador
+// 2 * pasos en lugar de una potencia de 2. Se empieza con 0.5 (resto =
+// pasos) y cada paso suma 2 * d al resto, asi que no se acumula error: el
+// pixel i es exactamente floor(x0 + i * dx / pasos + 0.5), igual que
+// roundi, para cualquier largo, y el ultimo es siempre (x1, y1).
+struct DdaAxis {
+    long long q, r, inc, den;
+
+    void init(int v0, long long d, long long steps) {
+        q = v0;
+        r = steps;
+        inc = 2 * d;
+        den = 2 * steps;
+    }
+
+    // |inc| <= den, asi que alcanza con un ajuste por paso
+    void step() {
+        r += inc;
+        if (r >= den) { r -= den; q++; }
+        else if (r < 0) { r += den; q--; }
+    }
+};
+
+template <class Sink>
+void lineDDAFixed(int x0, int y0, int x1, int y1, Sink &putPixel) {
+    long long dx = (long long) x1 - x0;
+    long long dy = (long long) y1 - y0;
+    long long steps = max(llabs(dx), llabs(dy));
+    if (steps == 0) {
+        putPixel(x0, y0);
+        return;
+    }
+
+    DdaAxis ax, ay;
+    ax.init(x0, dx, steps);
+    ay.init(y0, dy, steps);
+    for (long long i = 0; i <= steps; i++) {
+        putPixel((int) ax.q, (int) ay.q);
+        ax.step();
+        ay.step();
+    }
+}
+
+// Circulo Punto Medio
+template <class Sink>
+inline void circ8(int xc, int yc, int x, int y, Sink &putPixel) {
+    putPixel(xc + x, yc + y);
+    putPixel(xc - x, yc + y);
+    putPixel(xc + x, yc - y);
+    putPixel(xc - x, yc - y);
+    putPixel(xc + y, yc + x);
+    putPixel(xc - y, yc + x);
+    putPixel(xc + y, yc - x);
+    putPixel(xc - y, yc - x);
+}
+
+template <class Sink>
+void circlePM(int xc, int yc, int r, Sink &putPixel) {
+    int x = 0;
+    int y = r;
+    int p = 1 - r;
+
+    circ8(xc, yc, x, y, putPixel);
+
+    while (x < y) {
+        x++;
+        if (p < 0) {
+            p += 2 * x + 1;
+        }
+        else {
+            y--;
+            p += 2 * (x - y) + 1;
+        }
+        circ8(xc, yc, x, y, putPixel);
+    }
+}
+
+// Circulo Punto Medio por tramos en paralelo
+// Mientras x < y, el valor de y en el paso x es el mayor entero con
+// y * (y - 1) < r^2 - x^2, y la decision es p = (x + 1)^2 + y^2 - y - r^2.
+// Con eso cada hilo arranca su tramo de x sin depender del anterior y el
+// resultado es identico (incluso en orden) al del bucle serial.
+atomic<bool> parallelArcs(true);   // lo cambia GLUT y lo lee el hilo de render
+const int PARALLEL_ARC_MIN = 20000;
+
+long long circleYAt(long long r, long long x) {
+    long long d = r * r - x * x;
+    long long y = (long long) ((1 + sqrt((double) (1 + 4 * d))) / 2);
+    while (y > 0 && y * (y - 1) >= d) y--;
+    while ((y + 1) * y < d) y++;
+    return y;
+}
+
+// Ultimo x que dibuja el bucle serial (el primero con x >= y)
+long long circleLastX(long long r) {
+    long long lo = 0, hi = r;
+    while (lo < hi) {
+        long long mid = (lo + hi + 1) / 2;
+        if (mid < circleYAt(r, mid)) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo + 1;
+}
+
+void circlePMChunk(int xc, int yc, long long r, long long k0, long long k1, Point *out) {
+    long long x = k0;
+    long long y = circleYAt(r, k0);
+    long long p = (x + 1) * (x + 1) + y * y - y - r * r;
+    auto put = [&](int px, int py) { *out++ = {px, py}; };
+
+    circ8(xc, yc, (int) x, (int) y, put);
+    while (++x < k1) {
+        if (p < 0) {
+            p += 2 * x + 1;
+        }
+        else {
+            y--;
+            p += 2 * (x - y) + 1;
+        }
+        circ8(xc, yc, (int) x, (int) y, put);
+    }
+}
+
+void circlePMParallel(int xc, int yc, int r, vector<Point> &out) {
+    long long K = r > 0 ? circleLastX(r) : 0;
+    out.resize(8 * (size_t) (K + 1));
+
+    // Cada tramo debe empezar dentro del octante (x < y)
+    long long n = min<long long>(max(1u, thread::hardware_concurrency()), (K + 1) / 2);
+    if (n <= 1) {
+        circlePMChunk(xc, yc, r, 0, K + 1, out.data());
+        return;
+    }
+
+    vector<thread> workers;
+    for (long long c = 0; c < n; c++) {
+        long long k0 = c * (K + 1) / n;
+        long long k1 = (c + 1) * (K + 1) / n;
+        workers.emplace_back(circlePMChunk, xc, yc, (long long) r, k0, k1, out.data() + 8 * k0);
+    }
+    for (auto &w : workers) w.join();
+}
+
+// Elipse Punto Medio
+template <class Sink>
+inline void ellipse4(int xc, int yc, int x, int y, Sink &putPixel) {
+    putPixel(xc + x, yc + y);
+    putPixel(xc - x, yc + y);
+    putPixel(xc + x, yc - y);
+    putPixel(xc - x, yc - y);
+}
+
+template <class Sink>
+void ellipsePM(int xc, int yc, int rx, int ry, Sink &putPixel) {
+    // Con los dos radios en 0 la primera region no avanza nunca
+    if (rx == 0 && ry == 0) {
+        putPixel(xc, yc);
+        return;
+    }
+
+    int x = 0;
+    int y = ry;
+
+    // 64 bits: rx * rx no entra en int desde rx = 46341, y long es de
+    // 32 bits en Windows
+    long long rx2 = (long long) rx * rx;
+    long long ry2 = (long long) ry * ry;
+    long long two_rx2 = 2 * rx2;
+    long long two_ry2 = 2 * ry2;
+
+    double p1 = ry2 - rx2 * ry + 0.25 * rx2;
+
+    while ((two_ry2 * x) <= (two_rx2 * y)) {
+        ellipse4(xc, yc, x, y, putPixel);
+        if (p1 < 0) {
+            x++;
+            p1 += two_ry2 * x + ry2;
+        }
+        else {
+            x++;
+            y--;
+            p1 += two_ry2 * x - two_rx2 * y + ry2;
+        }
+    }
+
+    double p2 = ry2 * (x + 0.5) * (x + 0.5)
+               + rx2 * (y - 1) * (y - 1)
+               - rx2 * ry2;
+
+    while (y >= 0) {
+        ellipse4(xc, yc, x, y, putPixel);
+        if (p2 > 0) {
+            y--;
+            p2 -= two_rx2 * y + rx2;
+        }
+        else {
+            y--;
+            x++;
+            p2 += two_ry2 * x - two_rx2 * y + rx2;
+        }
+    }
+}
+
+// Bezier cubica por diferencias hacia adelante adaptativas, en punto fijo
+// 32.32: cada paso son tres sumas por eje. El paso se parte a la mitad si
+// avanza mas de un pixel y se duplica si avanza menos de medio, asi los
+// pixeles salen 8-conectados. Las curvas largas se dividen antes (de
+// Casteljau) para que el error acumulado en punto fijo no llegue a un pixel.
+const int AFD_FRAC = 32;
+const long long AFD_ONE = 1LL << AFD_FRAC;
+const int AFD_MAX_LEVEL = 20;     // paso minimo: 2^-20 del tramo
+const double AFD_PIECE = 256;     // largo maximo del poligono de control por tramo
+
+struct AfdAxis {
+    long long p, d1, d2, d3;
+
+    void init(const double *c, double h) {
+        double a = -c[0] + 3 * c[1] - 3 * c[2] + c[3];
+        double b = 3 * c[0] - 6 * c[1] + 3 * c[2];
+        double l = 3 * (c[1] - c[0]);
+        double A = a * h * h * h, B = b * h * h, C = l * h;
+        p = llround(c[0] * AFD_ONE);
+        d1 = llround((A + B + C) * AFD_ONE);
+        d2 = llround((6 * A + 2 * B) * AFD_ONE);
+        d3 = llround(6 * A * AFD_ONE);
+    }
+
+    void step() {
+        p += d1;
+        d1 += d2;
+        d2 += d3;
+    }
+
+    void halve() {
+        d1 = (d1 >> 1) - (d2 >> 3) + (d3 >> 4);
+        d2 = (d2 >> 2) - (d3 >> 3);
+        d3 >>= 3;
+    }
+
+    void grow() {
+        d1 = 2 * d1 + d2;
+        d2 = 4 * d2 + 4 * d3;
+        d3 *= 8;
+    }
+
+    int pixel() const { return (int) ((p + AFD_ONE / 2) >> AFD_FRAC); }
+};
+
+// Un tramo con poligono de control corto; (lx, ly) es el ultimo pixel
+// emitido, para no repetirlo entre pasos ni entre tramos
+template <class Sink>
+void bezierPiece(const double *cx, const double *cy, int &lx, int &ly, Sink &putPixel) {
+    double len = 0;
+    for (int i = 0; i < 3; i++) len += hypot(cx[i + 1] - cx[i], cy[i + 1] - cy[i]);
+    int level = min(AFD_MAX_LEVEL, (int) ceil(log2(len + 1)) + 1);
+
+    AfdAxis x, y;
+    x.init(cx, ldexp(1.0, -level));
+    y.init(cy, ldexp(1.0, -level));
+
+    const long long END = 1LL << AFD_MAX_LEVEL;
+    long long t = 0;
+    long long stepT = END >> level;
+
+    auto emit = [&](int px, int py) {
+        if (px == lx && py == ly) return;
+        putPixel(px, py);
+        lx = px;
+        ly = py;
+    };
+    emit(x.pixel(), y.pixel());
+
+    while (t < END) {
+        while (level > 0 && llabs(x.d1) < AFD_ONE / 2 && llabs(y.d1) < AFD_ONE / 2 && t % (2 * stepT) == 0) {
+            x.grow();
+            y.grow();
+            level--;
+            stepT <<= 1;
+        }
+        while (level < AFD_MAX_LEVEL && (llabs(x.d1) > AFD_ONE || llabs(y.d1) > AFD_ONE)) {
+            x.halve();
+            y.halve();
+            level++;
+            stepT >>= 1;
+        }
+        x.step();
+        y.step();
+        t += stepT;
+        emit(x.pixel(), y.pixel());
+    }
+
+    // El extremo exacto, por si el redondeo acumulado quedo a un pixel
+    emit(roundi(cx[3]), roundi(cy[3]));
+}
+
+template <class Sink>
+void bezierSplit(const double *cx, const double *cy, int depth, int &lx, int &ly, Sink &putPixel) {
+    double len = 0;
+    for (int i = 0; i < 3; i++) len += hypot(cx[i + 1] - cx[i], cy[i + 1] - cy[i]);
+    if (len <= AFD_PIECE || depth >= 16) {
+        bezierPiece(cx, cy, lx, ly, putPixel);
+        return;
+    }
+
+    double lcx[4], lcy[4], rcx[4], rcy[4];
+    auto split = [](const double *c, double *l, double *r) {
+        double m01 = (c[0] + c[1]) / 2, m12 = (c[1] + c[2]) / 2, m23 = (c[2] + c[3]) / 2;
+        double a = (m01 + m12) / 2, b = (m12 + m23) / 2, m = (a + b) / 2;
+        l[0] = c[0]; l[1] = m01; l[2] = a; l[3] = m;
+        r[0] = m; r[1] = b; r[2] = m23; r[3] = c[3];
+    };
+    split(cx, lcx, rcx);
+    split(cy, lcy, rcy);
+    bezierSplit(lcx, lcy, depth + 1, lx, ly, putPixel);
+    bezierSplit(rcx, rcy, depth + 1, lx, ly, putPixel);
+}
+
+template <class Sink>
+void bezierAFD(int x0, int y0, int x1, int y1, int x2, int y2, int x3, int y3, Sink &putPixel) {
+    double cx[4] = {(double) x0, (double) x1, (double) x2, (double) x3};
+    double cy[4] = {(double) y0, (double) y1, (double) y2, (double) y3};
+    int lx = INT_MIN, ly = INT_MIN;
+    bezierSplit(cx, cy, 0, lx, ly, putPixel);
+}
+
+// Relleno por tramos (scanline con pila de tramos)
+void floodFillSpans(unsigned int *px, int w, int h, int sx, int sy, unsigned int repl, SpanBuf &out) {
+    if (sx < 0 || sy < 0 || sx >= w || sy >= h) return;
+
+    unsigned int target = px[sy * w + sx];
+    if (target == repl) return;
+
+    auto &st = framePool.seeds;
+    st.clear();
+    st.push_back({sy, sx, sx, 1});
+    st.push_back({sy - 1, sx, sx, -1});
+
+    while (!st.empty()) {
+        SpanSeed sd = st.back();
+        st.pop_back();
+        if (sd.y < 0 || sd.y >= h) continue;
+
+        unsigned int *row = px + sd.y * w;
+        int x = sd.l;
+
+        while (x <= sd.r) {
+            if (row[x] != target) { x++; continue; }
+
+            int s = x;
+            while (s > 0 && row[s - 1] == target) s--;
+            int e = x;
+            while (e + 1 < w && row[e + 1] == target) e++;
+
+            for (int i = s; i <= e; i++) row[i] = repl;
+            out.push_back({sd.y, s, e - s + 1});
+
+            // Seguir en la misma direccion y regresar por lo que sobresale
+            st.push_back({sd.y + sd.dy, s, e, sd.dy});
+            if (s < sd.l) st.push_back({sd.y - sd.dy, s, sd.l - 1, -sd.dy});
+            if (e > sd.r) st.push_back({sd.y - sd.dy, sd.r + 1, e, -sd.dy});
+
+            x = e + 2;
+        }
+    }
+}
+
+// ---------------- Tramos ----------------
+// Convierte pixeles sueltos en tramos por fila (y, x, largo). Cada pixel
+// se estampa como un cuadrado de t x t; los tramos quedan ordenados por
+// fila y columna y sin solaparse.
+// Ordena tramos sueltos y junta los que se tocan o se pisan
+void mergeSpans(vector<Span> &raw, vector<Span> &out) {
+    sort(raw.begin(), raw.end(), [](const Span &a, const Span &b) {
+        return a.y != b.y ? a.y < b.y : a.x < b.x;
+    });
+
+    out.clear();
+    for (const Span &s : raw) {
+        if (!out.empty() && out.back().y == s.y && s.x <= out.back().x + out.back().len) {
+            Span &b = out.back();
+            b.len = max(b.len, s.x + s.len - b.x);
+        }
+        else out.push_back(s);
+    }
+    out.shrink_to_fit();
+}
+
+void stampSpans(const Point *pts, size_t n, int t, vector<Span> &out) {
+    int o = t / 2;
+    vector<Span> raw;
+    raw.reserve(n * t);
+    for (size_t i = 0; i < n; i++) {
+        for (int k = 0; k < t; k++) raw.push_back({pts[i].y - o + k, pts[i].x - o, t});
+    }
+    mergeSpans(raw, out);
+}
+
+// ---------------- Envio a OpenGL ----------------
+// Cada tramo se envia como una linea horizontal por el centro de la fila,
+// desplazado (dx, dy)
+void submitSpans(const vector<Span> &sp, int dx = 0, int dy = 0) {
+    if (sp.empty()) return;
+
+    PointBuf &buf = framePool.pointBuf();
+    for (const Span &s : sp) {
+        buf.push_back({dx + s.x, dy + s.y});
+        buf.push_back({dx + s.x + s.len, dy + s.y});
+    }
+
+    glPushMatrix();
+    glTranslatef(0, 0.5f, 0);
+    glLineWidth(1);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_INT, 0, buf.data());
+    glDrawArrays(GL_LINES, 0, (GLsizei) buf.size());
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPopMatrix();
+}
+
+// ---------------- Dibujo ----------------
+// Genera los pixeles de una figura (sin grosor) en el destino dado
+template <class Sink>
+void rasterShape(const Shape &s, Sink &put) {
+    if (s.type == LINE_DIRECT) {
+        lineDirect(s.x1, s.y1, s.x2, s.y2, put);
+    }
+    else if (s.type == LINE_DDA) {
+        lineDDA(s.x1, s.y1, s.x2, s.y2, put);
+    }
+    else if (s.type == LINE_DDA_FIXED) {
+        lineDDAFixed(s.x1, s.y1, s.x2, s.y2, put);
+    }
+    else if (s.type == CIRCLE_PM) {
+        circlePM(s.xc, s.yc, s.r, put);
+    }
+    else if (s.type == ELLIPSE_PM) {
+        ellipsePM(s.xc, s.yc, s.rx, s.ry, put);
+    }
+    else if (s.type == BEZIER_AFD) {
+        bezierAFD(s.x1, s.y1, s.cx1, s.cy1, s.cx2, s.cy2, s.x2, s.y2, put);
+    }
+}
+
+// ---------------- Cache de circulos y elipses ----------------
+// Tramos relativos al centro, por radio (circulo) o por (rx, ry) (elipse)
+// y grosor, con reemplazo LRU. Los tramos ya traen el grosor aplicado, asi
+// que el envio a OpenGL y el lienzo de exportacion usan la misma tabla.
+struct RasterKey {
+    int type, a, b, t;
+
+    bool operator==(const RasterKey &o) const {
+        return type == o.type && a == o.a && b == o.b && t == o.t;
+    }
+};
+
+struct RasterKeyHash {
+    size_t operator()(const RasterKey &k) const {
+        return ((size_t) k.type * 0x9E3779B97F4A7C15ull) ^ ((size_t) k.a * 0x85EBCA6Bull) ^
+               ((size_t) k.b << 1) ^ ((size_t) k.t * 0xC2B2AE35ull);
+    }
+};
+
+typedef shared_ptr<const vector<Span>> SpanTable;
+
+struct RasterCache {
+    struct Entry {
+        RasterKey key;
+        SpanTable table;
+    };
+
+    mutex lock;        // lo usan el hilo de render y las exportaciones
+    list<Entry> lru;   // el mas reciente al frente
+    unordered_map<RasterKey, list<Entry>::iterator, RasterKeyHash> map;
+    size_t spans = 0;
+    size_t pixels = 0;            // pixeles cubiertos por las tablas guardadas
+    size_t maxSpans = 1 << 22;
+    size_t hits = 0, misses = 0, evictions = 0;
+
+    static bool cacheable(const Shape &s) {
+        return s.type == CIRCLE_PM || s.type == ELLIPSE_PM;
+    }
+
+    static size_t covered(const vector<Span> &v) {
+        size_t n = 0;
+        for (const Span &s : v) n += s.len;
+        return n;
+    }
+
+    SpanTable get(const Shape &s) {
+        int t = max(s.thickness, 1);
+        RasterKey k = {s.type, s.type == CIRCLE_PM ? s.r : s.rx, s.type == CIRCLE_PM ? 0 : s.ry, t};
+        {
+            lock_guard<mutex> g(lock);
+            auto it = map.find(k);
+            if (it != map.end()) {
+                hits++;
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->table;
+            }
+            misses++;
+        }
+
+        // Se rasteriza sin el candado para que otros hilos sigan usando el
+        // cache; si alguien agrego la misma tabla mientras tanto se usa esa
+        Shape c = s;
+        c.xc = 0;
+        c.yc = 0;
+        vector<Point> pts;
+        if (s.type == CIRCLE_PM && parallelArcs && s.r >= PARALLEL_ARC_MIN) {
+            circlePMParallel(0, 0, s.r, pts);
+        }
+        else {
+            auto put = [&](int x, int y) { pts.push_back({x, y}); };
+            rasterShape(c, put);
+        }
+        auto sp = make_shared<vector<Span>>();
+        stampSpans(pts.data(), pts.size(), t, *sp);
+
+        lock_guard<mutex> g(lock);
+        auto it = map.find(k);
+        if (it != map.end()) return it->second->table;
+
+        // Una tabla mas grande que todo el cache no se guarda
+        if (sp->size() > maxSpans) return sp;
+
+        lru.push_front({k, sp});
+        map[k] = lru.begin();
+        spans += sp->size();
+        pixels += covered(*sp);
+        while (spans > maxSpans) {
+            spans -= lru.back().table->size();
+            pixels -= covered(*lru.back().table);
+            map.erase(lru.back().key);
+            lru.pop_back();
+            evictions++;
+        }
+        return sp;
+    }
+};
+
+RasterCache rasterCache;
+
+// Tramos de una figura y el desplazamiento con que se dibujan
+struct PlacedSpans {
+    SpanTable spans;
+    int dx, dy;
+};
+
+// Forma canonica de cualquier figura: los rellenos ya son tramos, los
+// circulos y elipses salen del cache y el resto se convierte al vuelo
+PlacedSpans shapeSpans(const Shape &s) {
+    if (s.type == FILL_SCAN) {
+        return {s.spans ? s.spans : make_shared<vector<Span>>(), 0, 0};
+    }
+    if (RasterCache::cacheable(s)) return {rasterCache.get(s), s.xc, s.yc};
+
+    vector<Point> pts;
+    auto put = [&](int x, int y) { pts.push_back({x, y}); };
+    rasterShape(s, put);
+    auto sp = make_shared<vector<Span>>();
+    stampSpans(pts.data(), pts.size(), max(s.thickness, 1), *sp);
+    return {sp, 0, 0};
+}
+
+void drawShape(const Shape &s) {
+    glColor3f(s.color.r, s.color.g, s.color.b);
+    PlacedSpans p = shapeSpans(s);
+    forInstances(s, [&](int dx, int dy) { submitSpans(*p.spans, p.dx + dx, p.dy + dy); });
+}
+
+// ---------------- Escena publicada ----------------
+// El hilo de escena publica copias inmutables de la escena y el hilo de
+// render publica los pixeles de cada capa; GLUT solo los envia a OpenGL.
+struct SceneSnapshot {
+    ShapeList shapes;
+    unsigned int selectedId = 0;
+    size_t selectedIndex = 0;
+    int maxLayer = 0;     // capa mas alta usada (el servidor puede crear capas)
+};
+
+// Tramos de una figura listos para enviar; las repetidas guardan los
+// tramos de una copia y los desplazamientos
+struct ShapeRaster {
+    Color color;
+    PlacedSpans spans;
+    Offsets offsets;
+};
+
+typedef shared_ptr<const ShapeRaster> ShapeRasterPtr;
+
+struct LayerRaster {
+    vector<ShapeRasterPtr> shapes;
+};
+
+struct RenderedFrame {
+    shared_ptr<const SceneSnapshot> scene;
+    vector<shared_ptr<const LayerRaster>> layers;   // por indice de capa
+};
+
+// Se leen y escriben con atomic_load / atomic_store
+shared_ptr<const SceneSnapshot> latestScene = make_shared<SceneSnapshot>();
+shared_ptr<const RenderedFrame> latestFrame = make_shared<RenderedFrame>();
+
+void submitRaster(const ShapeRaster &r) {
+    glColor3f(r.color.r, r.color.g, r.color.b);
+    submitSpans(*r.spans.spans, r.spans.dx, r.spans.dy);
+}
+
+// Compone las capas visibles en orden. Una capa solo se vuelve a armar
+// cuando el hilo de render publico un raster nuevo para ella. Cada figura
+// repetida tiene su propia lista con una copia, y la capa solo guarda un
+// desplazamiento y una llamada por copia.
+size_t layerRebuilds = 0;   // listas de capa rearmadas
+
+void drawLayers() {
+    shared_ptr<const RenderedFrame> frame = atomic_load(&latestFrame);
+
+    for (int li : layerOrder) {
+        Layer &L = layers[li];
+        if (!L.visible || li >= (int) frame->layers.size()) continue;
+
+        const shared_ptr<const LayerRaster> &lr = frame->layers[li];
+        if (L.built != lr || !L.list) {
+            if (!L.list) L.list = glGenLists(1);
+            for (GLuint s : L.stamps) glDeleteLists(s, 1);
+            L.stamps.clear();
+
+            // Las listas no se pueden anidar mientras se compilan, asi que
+            // las copias se arman antes que la de la capa
+            if (lr) {
+                for (auto &r : lr->shapes) {
+                    if (!r->offsets) continue;
+                    GLuint s = glGenLists(1);
+                    glNewList(s, GL_COMPILE);
+                    submitSpans(*r->spans.spans, r->spans.dx, r->spans.dy);
+                    glEndList();
+                    framePool.reset();
+                    L.stamps.push_back(s);
+                }
+            }
+
+            glNewList(L.list, GL_COMPILE);
+            if (lr) {
+                size_t k = 0;
+                for (auto &r : lr->shapes) {
+                    if (r->offsets) {
+                        GLuint s = L.stamps[k++];
+                        glColor3f(r->color.r, r->color.g, r->color.b);
+                        for (const Point &o : *r->offsets) {
+                            glPushMatrix();
+                            glTranslatef(o.x, o.y, 0);
+                            glCallList(s);
+                            glPopMatrix();
+                        }
+                        continue;
+                    }
+                    submitRaster(*r);
+                    framePool.reset();
+                }
+            }
+            glEndList();
+            L.built = lr;
+            layerRebuilds++;
+        }
+        glCallList(L.list);
+    }
+}
+
+// ---------------- Comparacion de algoritmos ----------------
+// Rasteriza la figura seleccionada con cada algoritmo que puede dibujarla,
+// mide el tiempo con corridas repetidas y marca encima del dibujo los
+// pixeles en que cada alternativa difiere del primero de la lista.
+struct AlgoVariant {
+    const char *name;
+    function<void(const Shape &, vector<Point> &)> run;
+};
+
+vector<AlgoVariant> variantsFor(const Shape &s) {
+    vector<AlgoVariant> v;
+    if (isLine(s.type)) {
+        v.push_back({"Directa", [](const Shape &s, vector<Point> &o) {
+            auto put = [&](int x, int y) { o.push_back({x, y}); };
+            lineDirect(s.x1, s.y1, s.x2, s.y2, put);
+        }});
+        v.push_back({"DDA", [](const Shape &s, vector<Point> &o) {
+            auto put = [&](int x, int y) { o.push_back({x, y}); };
+            lineDDA(s.x1, s.y1, s.x2, s.y2, put);
+        }});
+        v.push_back({"DDA punto fijo", [](const Shape &s, vector<Point> &o) {
+            auto put = [&](int x, int y) { o.push_back({x, y}); };
+            lineDDAFixed(s.x1, s.y1, s.x2, s.y2, put);
+        }});
+    }
+    else if (s.type == CIRCLE_PM || (s.type == ELLIPSE_PM && s.rx == s.ry)) {
+        int r = s.type == CIRCLE_PM ? s.r : s.rx;
+        v.push_back({"Circulo PM", [r](const Shape &s, vector<Point> &o) {
+            auto put = [&](int x, int y) { o.push_back({x, y}); };
+            circlePM(s.xc, s.yc, r, put);
+        }});
+        v.push_back({"Circulo PM paralelo", [r](const Shape &s, vector<Point> &o) {
+            circlePMParallel(s.xc, s.yc, r, o);
+        }});
+        v.push_back({"Elipse PM (rx = ry)", [r](const Shape &s, vector<Point> &o) {
+            auto put = [&](int x, int y) { o.push_back({x, y}); };
+            ellipsePM(s.xc, s.yc, r, r, put);
+        }});
+    }
+    return v;
+}
+
+struct CompareMark {
+    Color color;
+    vector<Point> pts;
+};
+
+vector<CompareMark> compareMarks;   // vacio = sin comparacion activa
+
+void compareAlgorithms(const Shape &s) {
+    compareMarks.clear();
+    vector<AlgoVariant> v = variantsFor(s);
+    if (v.size() < 2) {
+        cout << "Comparacion: no hay algoritmos alternativos para esta figura" << endl;
+        return;
+    }
+
+    static const Color palette[] = {{0, 0.4f, 1}, {0, 0.7f, 0}, {0.7f, 0, 0.8f}};
+    auto key = [](const Point &p) { return ((long long) p.x << 32) ^ (unsigned int) p.y; };
+
+    cout << "Comparacion (" << v.size() << " algoritmos, base: " << v[0].name << ")" << endl;
+    unordered_set<long long> base;
+    vector<Point> out;
+    for (size_t i = 0; i < v.size(); i++) {
+        // Corridas repetidas hasta juntar al menos 30 ms
+        int runs = 0;
+        auto t0 = chrono::steady_clock::now();
+        double ms = 0;
+        do {
+            out.clear();
+            v[i].run(s, out);
+            runs++;
+            ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        } while ((ms < 30 || runs < 3) && runs < 1000);
+
+        unordered_set<long long> mine;
+        for (const Point &p : out) mine.insert(key(p));
+
+        cout << "  " << v[i].name << ": " << ms * 1000 / runs << " us por corrida (" << runs
+             << " corridas), " << out.size() << " pixeles emitidos, " << mine.size() << " distintos";
+
+        if (i == 0) {
+            base.swap(mine);
+            cout << endl;
+            continue;
+        }
+
+        CompareMark extra{palette[(i - 1) % 3], {}};
+        CompareMark missing{{1, 0, 0}, {}};
+        for (const Point &p : out) {
+            if (!base.count(key(p))) extra.pts.push_back(p);
+        }
+        for (long long k : base) {
+            if (!mine.count(k)) missing.pts.push_back({(int) (k >> 32), (int) (unsigned int) k});
+        }
+        cout << ", " << extra.pts.size() << " solo aqui, " << missing.pts.size()
+             << " solo en la base" << endl;
+        compareMarks.push_back(move(extra));
+        compareMarks.push_back(move(missing));
+    }
+}
+
+void drawCompareMarks() {
+    for (const CompareMark &m : compareMarks) {
+        if (m.pts.empty()) continue;
+        glColor3f(m.color.r, m.color.g, m.color.b);
+        glPointSize(3);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(2, GL_INT, 0, m.pts.data());
+        glDrawArrays(GL_POINTS, 0, (GLsizei) m.pts.size());
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+    glPointSize(1);
+}
+
+// Tecla k: compara la figura seleccionada (o la ultima) y la segunda vez
+// quita las marcas
+void toggleCompare() {
+    if (!compareMarks.empty()) {
+        compareMarks.clear();
+        return;
+    }
+    shared_ptr<const SceneSnapshot> scene = atomic_load(&latestScene);
+    if (scene->shapes.empty()) return;
+
+    size_t i = scene->shapes.size() - 1;
+    if (scene->selectedIndex < scene->shapes.size() &&
+        scene->shapes[scene->selectedIndex].id == scene->selectedId) {
+        i = scene->selectedIndex;
+    }
+    compareAlgorithms(scene->shapes[i]);
+}
+
+#ifdef CAD_ALLOC_CHECK
+// Un frame esta en regimen estable si dibuja la misma escena y el mismo
+// raster que el anterior sin rearmar listas de capa
+void checkSteadyFrame(size_t allocs, bool rebuilt) {
+    static shared_ptr<const SceneSnapshot> lastScene;
+    static shared_ptr<const RenderedFrame> lastFrame;
+    shared_ptr<const SceneSnapshot> scene = atomic_load(&latestScene);
+    shared_ptr<const RenderedFrame> frame = atomic_load(&latestFrame);
+    bool steady = !rebuilt && scene == lastScene && frame == lastFrame;
+    lastScene = scene;
+    lastFrame = frame;
+    if (steady && allocs > 0) {
+        cout << "Control de memoria: un frame estable hizo " << allocs << " reservas" << endl;
+        exit(1);
+    }
+}
+#endif
+
+// Tramos del resaltado de la figura seleccionada. Una figura no cambia
+// despues de recibir su id, asi que se rasteriza de nuevo solo cuando
+// cambia la seleccion.
+struct Highlight {
+    unsigned int id = 0;
+    PlacedSpans spans;
+};
+
+Highlight highlight;
+
+void redrawAll() {
+#ifdef CAD_ALLOC_CHECK
+    size_t allocs = threadAllocCount;
+    size_t rebuilds = layerRebuilds;
+#endif
+    framePool.reset();
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Coordenadas del lienzo
+    glLoadIdentity();
+    glTranslatef(-viewX, -viewY, 0);
+
+    int x0 = viewX;
+    int y0 = viewY;
+    int x1 = min(viewX + viewportW, canvasW);
+    int y1 = min(viewY + viewportH, canvasH);
+
+    // Dibujar grid (solo la parte visible)
+    if (showGrid) {
+        glColor3f(0.85, 0.85, 0.85);
+        glBegin(GL_LINES);
+        for (int x = x0 - x0 % 20; x <= x1; x += 20) {
+            glVertex2i(x, y0);
+            glVertex2i(x, y1);
+        }
+        for (int y = y0 - y0 % 20; y <= y1; y += 20) {
+            glVertex2i(x0, y);
+            glVertex2i(x1, y);
+        }
+        glEnd();
+    }
+
+    // Dibujar ejes
+    if (showAxes) {
+        glColor3f(0.6, 0.6, 0.6);
+        glBegin(GL_LINES);
+        glVertex2i(x0, canvasH / 2);
+        glVertex2i(x1, canvasH / 2);
+        glVertex2i(canvasW / 2, y0);
+        glVertex2i(canvasW / 2, y1);
+        glEnd();
+    }
+
+    // Dibujar figuras guardadas
+    drawLayers();
+
+    // Resaltar la figura seleccionada
+    shared_ptr<const SceneSnapshot> scene = atomic_load(&latestScene);
+    size_t si = scene->selectedIndex;
+    // La capa puede no existir aun: la crea pipelineTimer despues de que el
+    // hilo de escena publica la figura
+    if (si < scene->shapes.size() && scene->shapes[si].id == scene->selectedId &&
+        scene->shapes[si].layer < (int) layers.size() && layers[scene->shapes[si].layer].visible) {
+        const Shape &sel = scene->shapes[si];
+        if (sel.type == FILL_SCAN) {
+            Box b = shapeBox(sel);
+            glColor3f(1, 0.6f, 0);
+            glBegin(GL_LINE_LOOP);
+            glVertex2i(b.x0, b.y0);
+            glVertex2i(b.x1 + 1, b.y0);
+            glVertex2i(b.x1 + 1, b.y1 + 1);
+            glVertex2i(b.x0, b.y1 + 1);
+            glEnd();
+        }
+        else {
+            if (highlight.id != sel.id) {
+                Shape hl = sel;
+                hl.thickness += 2;
+                highlight.id = sel.id;
+                highlight.spans = shapeSpans(hl);
+            }
+            const PlacedSpans &p = highlight.spans;
+            glColor3f(1, 0.6f, 0);
+            forInstances(sel, [&](int dx, int dy) { submitSpans(*p.spans, p.dx + dx, p.dy + dy); });
+            framePool.reset();
+        }
+    }
+
+    drawCompareMarks();
+#ifdef CAD_ALLOC_CHECK
+    checkSteadyFrame(threadAllocCount - allocs, layerRebuilds != rebuilds);
+#endif
+}
+
+// Relleno: dibuja solo las figuras en el back buffer (sin grid ni ejes),
+// lo lee y calcula los tramos a partir de la semilla. La semilla y los
+// tramos estan en coordenadas del lienzo; solo se rellena la parte visible.
+shared_ptr<const vector<Span>> computeFill(int sx, int sy, const Color &c) {
+    int w = min(viewportW, canvasW - viewX);
+    int h = min(viewportH, canvasH - viewY);
+
+    glLoadIdentity();
+    glTranslatef(-viewX, -viewY, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    drawLayers();
+
+    if (w <= 0 || h <= 0) return make_shared<const vector<Span>>();
+
+    unsigned int *px = (unsigned int*) framePool.scratchBuf(4 * (size_t) w * h);
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, px);
+
+    unsigned char rgba[4] = {
+        (unsigned char) roundi(c.r * 255), (unsigned char) roundi(c.g * 255),
+        (unsigned char) roundi(c.b * 255), 255
+    };
+    unsigned int repl;
+    memcpy(&repl, rgba, 4);
+
+    SpanBuf &out = framePool.spanBuf();
+    floodFillSpans(px, w, h, sx - viewX, sy - viewY, repl, out);
+    for (Span &s : out) {
+        s.x += viewX;
+        s.y += viewY;
+    }
+    return make_shared<const vector<Span>>(out.begin(), out.end());
+}
+
+// ---------------- Formatos de imagen ----------------
+// Los exportadores piden las filas RGB de arriba hacia abajo (y = 0 arriba)
+typedef function<void(int y, unsigned char *out)> RowSource;
+
+bool writePPM(FILE *f, int w, int h, const RowSource &rows) {
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    unsigned char *line = framePool.lineBuf(3 * (size_t) w);
+    for (int y = 0; y < h; y++) {
+        rows(y, line);
+        if (fwrite(line, 3, w, f) != (size_t) w) return false;
+    }
+    return true;
+}
+
+// QOI (https://qoiformat.org) por franjas de filas codificadas en paralelo.
+// Cada franja salvo la primera escribe su primer pixel completo
+// (QOI_OP_RGB), que no depende del pixel anterior, asi no hace falta leer
+// la fila previa. Empieza con un indice vacio: solo usa QOI_OP_INDEX
+// para pixeles que ella misma ya escribio, que el decodificador tambien
+// tiene en ese lugar. Las corridas se cierran al final de cada franja, asi
+// las franjas se concatenan en un archivo QOI valido.
+inline int qoiHash(const unsigned char *p) {
+    return (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+}
+
+void qoiEncodeStrip(const RowSource &rows, int w, int y0, int y1, vector<unsigned char> &out) {
+    vector<unsigned char> line(3 * (size_t) w);
+    unsigned char prev[3] = {0, 0, 0};
+    unsigned char index[64][3];
+    bool valid[64] = {false};
+    int run = 0;
+    bool absolute = y0 > 0;
+
+    out.clear();
+    for (int y = y0; y < y1; y++) {
+        rows(y, line.data());
+        for (int x = 0; x < w; x++) {
+            const unsigned char *px = &line[3 * x];
+
+            if (absolute) {
+                out.push_back(0xfe);
+                out.push_back(px[0]);
+                out.push_back(px[1]);
+                out.push_back(px[2]);
+                int h = qoiHash(px);
+                memcpy(index[h], px, 3);
+                valid[h] = true;
+                memcpy(prev, px, 3);
+                absolute = false;
+                continue;
+            }
+
+            if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+                if (++run == 62) {
+                    out.push_back(0xc0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run) {
+                out.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+
+            int h = qoiHash(px);
+            if (valid[h] && memcmp(index[h], px, 3) == 0) {
+                out.push_back(h);
+            }
+            else {
+                memcpy(index[h], px, 3);
+                valid[h] = true;
+
+                int dr = (signed char) (px[0] - prev[0]);
+                int dg = (signed char) (px[1] - prev[1]);
+                int db = (signed char) (px[2] - prev[2]);
+                int dr_dg = dr - dg;
+                int db_dg = db - dg;
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                }
+                else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out.push_back(0x80 | (dg + 32));
+                    out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+                }
+                else {
+                    out.push_back(0xfe);
+                    out.push_back(px[0]);
+                    out.push_back(px[1]);
+                    out.push_back(px[2]);
+                }
+            }
+            memcpy(prev, px, 3);
+        }
+    }
+    if (run) out.push_back(0xc0 | (run - 1));
+}
+
+bool writeQOI(FILE *f, int w, int h, const RowSource &rows) {
+    unsigned char header[14] = {'q', 'o', 'i', 'f',
+        (unsigned char) (w >> 24), (unsigned char) (w >> 16), (unsigned char) (w >> 8), (unsigned char) w,
+        (unsigned char) (h >> 24), (unsigned char) (h >> 16), (unsigned char) (h >> 8), (unsigned char) h,
+        3, 0};
+    fwrite(header, 1, sizeof header, f);
+
+    // Franjas de ~1 MB de pixeles, de a una por hilo
+    int workers = max(1u, thread::hardware_concurrency());
+    int stripRows = max(16, (1 << 20) / max(w, 1));
+    vector<vector<unsigned char>> out(workers);
+
+    for (int y = 0; y < h; y += stripRows * workers) {
+        vector<thread> pool;
+        int n = 0;
+        for (; n < workers && y + n * stripRows < h; n++) {
+            int y0 = y + n * stripRows;
+            int y1 = min(h, y0 + stripRows);
+            pool.emplace_back(qoiEncodeStrip, cref(rows), w, y0, y1, ref(out[n]));
+        }
+        for (auto &t : pool) t.join();
+        for (int i = 0; i < n; i++) {
+            if (fwrite(out[i].data(), 1, out[i].size(), f) != out[i].size()) return false;
+        }
+    }
+
+    static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    return fwrite(end, 1, 8, f) == 8;
+}
+
+// BMP de 8 bits con paleta: 1 byte por pixel. Las filas se guardan de
+// abajo hacia arriba y se rellenan a multiplos de 4 bytes. El formato
+// guarda el tamano del archivo en 32 bits; uno mas grande no se escribe.
+bool writeBMP8(FILE *f, int w, int h, const unsigned char (*palette)[3], int colors, const RowSource &indexRows) {
+    int stride = (w + 3) & ~3;
+    unsigned int offset = 14 + 40 + 256 * 4;
+    unsigned long long total = offset + (unsigned long long) stride * h;
+    if (total > 0xFFFFFFFFull) return false;
+    unsigned int size = (unsigned int) total;
+
+    ByteWriter hd;
+    hd.u8('B'); hd.u8('M');
+    hd.u32(size);
+    hd.u32(0);
+    hd.u32(offset);
+    hd.u32(40);
+    hd.u32(w);
+    hd.u32(h);
+    hd.u8(1); hd.u8(0);       // planos
+    hd.u8(8); hd.u8(0);       // bits por pixel
+    hd.u32(0);                // sin compresion
+    hd.u32((unsigned int) stride * h);
+    hd.u32(2835);             // 72 dpi
+    hd.u32(2835);
+    hd.u32(colors);
+    hd.u32(0);
+    for (int i = 0; i < 256; i++) {
+        const unsigned char *c = i < colors ? palette[i] : palette[0];
+        hd.u8(c[2]); hd.u8(c[1]); hd.u8(c[0]); hd.u8(0);
+    }
+    if (fwrite(hd.b.data(), 1, hd.b.size(), f) != hd.b.size()) return false;
+
+    unsigned char *line = framePool.lineBuf(stride);
+    memset(line, 0, stride);
+    for (int y = h - 1; y >= 0; y--) {
+        indexRows(y, line);
+        if (fwrite(line, 1, stride, f) != (size_t) stride) return false;
+    }
+    return true;
+}
+
+bool hasExtension(const string &name, const char *ext) {
+    size_t n = strlen(ext);
+    return name.size() > n && name.compare(name.size() - n, n, ext) == 0;
+}
+
+// Elige el formato por la extension del archivo (.qoi o PPM)
+bool writeImage(const string &filename, int w, int h, const RowSource &rows) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        cout << "No se pudo abrir " << filename << endl;
+        return false;
+    }
+
+    bool ok = hasExtension(filename, ".qoi") ? writeQOI(f, w, h, rows) : writePPM(f, w, h, rows);
+    ok = fclose(f) == 0 && ok;
+    if (!ok) cout << "Error al escribir " << filename << endl;
+    return ok;
+}
+
+// Guardar la ventana (PPM o QOI)
+void exportWindow(const string &filename) {
+    int w = viewportW;
+    int h = viewportH;
+
+    unsigned char *pixels = framePool.scratchBuf(3 * (size_t) w * h);
+    glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+
+    auto rows = [&](int y, unsigned char *out) {
+        memcpy(out, &pixels[(size_t) (h - 1 - y) * w * 3], 3 * (size_t) w);
+    };
+    if (writeImage(filename, w, h, rows)) cout << "Exportado " << filename << endl;
+}
+
+// ---------------- Lienzo por bloques ----------------
+// Paleta del lienzo indexado. El indice 0 es el fondo blanco; cuando se
+// llenan los 256 lugares los colores nuevos usan el mas parecido.
+struct Palette {
+    unsigned char colors[256][3];
+    int size = 0;
+    unordered_map<unsigned int, unsigned char> lookup;
+
+    void reset() {
+        lookup.clear();
+        size = 0;
+        unsigned char white[3] = {255, 255, 255};
+        index(white);
+    }
+
+    unsigned char index(const unsigned char rgb[3]) {
+        unsigned int key = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+        auto it = lookup.find(key);
+        if (it != lookup.end()) return it->second;
+
+        unsigned char i;
+        if (size < 256) {
+            i = (unsigned char) size++;
+            memcpy(colors[i], rgb, 3);
+        }
+        else {
+            int best = INT_MAX;
+            i = 0;
+            for (int k = 0; k < 256; k++) {
+                int dr = colors[k][0] - rgb[0], dg = colors[k][1] - rgb[1], db = colors[k][2] - rgb[2];
+                int d = dr * dr + dg * dg + db * db;
+                if (d < best) {
+                    best = d;
+                    i = (unsigned char) k;
+                }
+            }
+        }
+        lookup[key] = i;
+        return i;
+    }
+};
+
+// Lienzo de hasta 64k x 64k dividido en bloques de TILE x TILE, en RGB o
+// indexado (1 byte por pixel con paleta). Los bloques se reservan solo
+// cuando se pinta en ellos; un bloque sin reservar es blanco.
+struct TiledCanvas {
+    int w = 0, h = 0;
+    int tilesX = 0, tilesY = 0;
+    bool indexed = false;
+    Palette palette;
+    vector<unique_ptr<unsigned char[]>> tiles;
+    size_t allocated = 0;
+    const vector<char> *mask = NULL;   // si esta, solo se pinta en estos bloques
+
+    int bpp() const { return indexed ? 1 : 3; }
+
+    size_t bytes() const { return allocated * TILE * TILE * bpp(); }
+
+    void resize(int nw, int nh) {
+        w = nw;
+        h = nh;
+        tilesX = (w + TILE - 1) / TILE;
+        tilesY = (h + TILE - 1) / TILE;
+        clear();
+    }
+
+    void clear() {
+        tiles.clear();
+        tiles.resize((size_t) tilesX * tilesY);
+        allocated = 0;
+        palette.reset();
+    }
+
+    // Vuelve el bloque a blanco
+    void dropTile(size_t i) {
+        if (tiles[i]) allocated--;
+        tiles[i].reset();
+    }
+
+    unsigned char *tile(int tx, int ty) {
+        unique_ptr<unsigned char[]> &t = tiles[(size_t) ty * tilesX + tx];
+        if (!t) {
+            t.reset(new unsigned char[TILE * TILE * bpp()]);
+            memset(t.get(), indexed ? 0 : 255, TILE * TILE * bpp());
+            allocated++;
+        }
+        return t.get();
+    }
+
+    // Pinta [x, x + len) en la fila y, recortado al lienzo
+    void fillRow(int y, int x, int len, const unsigned char rgb[3]) {
+        if (y < 0 || y >= h) return;
+        int xe = min(x + len, w);
+        x = max(x, 0);
+        size_t rowTiles = (size_t) (y / TILE) * tilesX;
+        if (indexed) {
+            unsigned char i = palette.index(rgb);
+            while (x < xe) {
+                int tx = x / TILE;
+                int n = min(xe, (tx + 1) * TILE) - x;
+                if (!mask || (*mask)[rowTiles + tx]) {
+                    memset(tile(tx, y / TILE) + (y % TILE) * TILE + x % TILE, i, n);
+                }
+                x += n;
+            }
+            return;
+        }
+        while (x < xe) {
+            int tx = x / TILE;
+            int n = min(xe, (tx + 1) * TILE) - x;
+            if (mask && !(*mask)[rowTiles + tx]) {
+                x += n;
+                continue;
+            }
+            unsigned char *p = tile(tx, y / TILE) + ((y % TILE) * TILE + x % TILE) * 3;
+            for (int i = 0; i < n; i++, p += 3) {
+                p[0] = rgb[0];
+                p[1] = rgb[1];
+                p[2] = rgb[2];
+            }
+            x += n;
+        }
+    }
+
+    // Copia en out la parte de la fila y que cae en el bloque tx, en RGB;
+    // devuelve cuantos pixeles son
+    int rowPart(int y, int tx, unsigned char *out) const {
+        int n = min(w - tx * TILE, TILE);
+        const unique_ptr<unsigned char[]> &t = tiles[(size_t) (y / TILE) * tilesX + tx];
+        if (!t) memset(out, 255, n * 3);
+        else if (!indexed) memcpy(out, t.get() + (y % TILE) * TILE * 3, n * 3);
+        else {
+            const unsigned char *p = t.get() + (y % TILE) * TILE;
+            for (int i = 0; i < n; i++) memcpy(out + 3 * i, palette.colors[p[i]], 3);
+        }
+        return n;
+    }
+
+    // Copia la fila y completa en out (w * 3 bytes)
+    void row(int y, unsigned char *out) const {
+        for (int tx = 0; tx < tilesX; tx++) out += 3 * rowPart(y, tx, out);
+    }
+
+    // Indices de la fila y (w bytes); solo en modo indexado
+    void indexRow(int y, unsigned char *out) const {
+        int ty = y / TILE;
+        for (int tx = 0; tx < tilesX; tx++) {
+            int n = min(w - tx * TILE, TILE);
+            const unique_ptr<unsigned char[]> &t = tiles[(size_t) ty * tilesX + tx];
+            if (t) memcpy(out, t.get() + (y % TILE) * TILE, n);
+            else memset(out, 0, n);
+            out += n;
+        }
+    }
+};
+
+bool indexedCanvas = false;   // --indexed: lienzo de exportacion de 1 byte por pixel
+
+void shapeRGB(const Shape &s, unsigned char rgb[3]) {
+    rgb[0] = (unsigned char) roundi(s.color.r * 255);
+    rgb[1] = (unsigned char) roundi(s.color.g * 255);
+    rgb[2] = (unsigned char) roundi(s.color.b * 255);
+}
+
+// Pinta los tramos de la figura (con su grosor) en el lienzo, solo los de
+// las filas [y0, y1)
+void rasterToCanvas(TiledCanvas &cv, const Shape &s, int y0 = INT_MIN, int y1 = INT_MAX) {
+    unsigned char rgb[3];
+    shapeRGB(s, rgb);
+
+    PlacedSpans p = shapeSpans(s);
+    forInstances(s, [&](int dx, int dy) {
+        for (const Span &sp : *p.spans) {
+            int y = p.dy + dy + sp.y;
+            if (y >= y0 && y < y1) cv.fillRow(y, p.dx + dx + sp.x, sp.len, rgb);
+        }
+    });
+}
+
+// ---------------- Exportacion incremental ----------------
+// De un PPM se guarda la escena y la paleta con que se hizo, no sus pixeles.
+// La siguiente exportacion al mismo archivo pinta en un lienzo nuevo solo
+// los bloques que tocan figuras agregadas o quitadas desde entonces, y en
+// el archivo reescribe solo los bytes de esos bloques.
+struct ExportState {
+    string file;
+    int w = 0, h = 0;
+    bool indexed = false;
+    Palette palette;                           // colores ya usados (lienzo indexado)
+    vector<int> order;                         // capas visibles, de abajo hacia arriba
+    shared_ptr<const SceneSnapshot> scene;     // NULL si no hay exportacion guardada
+};
+
+ExportState lastExport;
+
+// Bloques [x0, x1] x [y0, y1] que cubre la caja; false si cae fuera
+bool boxTiles(const Box &b, const TiledCanvas &cv, int &x0, int &y0, int &x1, int &y1) {
+    if (b.x1 < 0 || b.y1 < 0 || b.x0 >= cv.w || b.y0 >= cv.h) return false;
+    x0 = max(b.x0, 0) / TILE;
+    y0 = max(b.y0, 0) / TILE;
+    x1 = min(b.x1, cv.w - 1) / TILE;
+    y1 = min(b.y1, cv.h - 1) / TILE;
+    return true;
+}
+
+string ppmHeader(int w, int h) {
+    char hd[64];
+    snprintf(hd, sizeof hd, "P6\n%d %d\n255\n", w, h);
+    return hd;
+}
+
+vector<int> visibleOrder() {
+    vector<int> v;
+    for (int li : layerOrder) {
+        if (layers[li].visible) v.push_back(li);
+    }
+    return v;
+}
+
+// fseek/ftell con long no pasan de 2 GB en Windows (long es de 32 bits)
+bool seekFile(FILE *f, long long off, int whence) {
+#ifdef _WIN32
+    return _fseeki64(f, off, whence) == 0;
+#else
+    return fseeko(f, (off_t) off, whence) == 0;
+#endif
+}
+
+long long fileSize(const string &name) {
+    FILE *f = fopen(name.c_str(), "rb");
+    if (!f) return -1;
+    long long n = -1;
+    if (seekFile(f, 0, SEEK_END)) {
+#ifdef _WIN32
+        n = _ftelli64(f);
+#else
+        n = ftello(f);
+#endif
+    }
+    fclose(f);
+    return n;
+}
+
+// true si se pudo exportar parcheando el archivo de la vez anterior; si no,
+// hay que exportar completo
+bool exportIncremental(const string &filename, const shared_ptr<const SceneSnapshot> &scene) {
+    ExportState &le = lastExport;
+    string header = ppmHeader(canvasW, canvasH);
+    if (!le.scene || le.file != filename || le.w != canvasW || le.h != canvasH ||
+        le.indexed != indexedCanvas || le.order != visibleOrder() ||
+        fileSize(filename) != (long long) header.size() + 3LL * canvasW * canvasH) {
+        return false;
+    }
+
+    // Lienzo vacio con la paleta de la vez anterior; solo se reservan los
+    // bloques sucios en los que se pinta algo
+    TiledCanvas canvas;
+    canvas.indexed = le.indexed;
+    canvas.resize(le.w, le.h);
+    canvas.palette = le.palette;
+
+    // Bloques tocados por figuras que aparecieron o desaparecieron
+    vector<char> dirty((size_t) canvas.tilesX * canvas.tilesY, 0);
+    vector<char> visible(layers.size(), 0);
+    for (int li : le.order) visible[li] = 1;
+    auto mark = [&](const Shape &s) {
+        if (s.layer >= (int) visible.size() || !visible[s.layer]) return;
+        // Una figura repetida solo ensucia los bloques de sus copias
+        Box b = baseBox(s);
+        forInstances(s, [&](int dx, int dy) {
+            int x0, y0, x1, y1;
+            if (!boxTiles({b.x0 + dx, b.y0 + dy, b.x1 + dx, b.y1 + dy}, canvas, x0, y0, x1, y1)) return;
+            for (int ty = y0; ty <= y1; ty++) {
+                for (int tx = x0; tx <= x1; tx++) dirty[(size_t) ty * canvas.tilesX + tx] = 1;
+            }
+        });
+    };
+    unordered_set<unsigned int> before, after;
+    for (auto &s : le.scene->shapes) before.insert(s.id);
+    for (auto &s : scene->shapes) {
+        after.insert(s.id);
+        if (!before.count(s.id)) mark(s);
+    }
+    for (auto &s : le.scene->shapes) {
+        if (!after.count(s.id)) mark(s);
+    }
+
+    size_t n = count(dirty.begin(), dirty.end(), 1);
+
+    // Se pintan, solo dentro de esos bloques, las figuras que los tocan
+    canvas.mask = &dirty;
+    for (int li : le.order) {
+        for (auto &s : scene->shapes) {
+            int x0, y0, x1, y1;
+            if (s.layer != li || !boxTiles(shapeBox(s), canvas, x0, y0, x1, y1)) continue;
+            bool hit = false;
+            for (int ty = y0; ty <= y1 && !hit; ty++) {
+                for (int tx = x0; tx <= x1 && !hit; tx++) hit = dirty[(size_t) ty * canvas.tilesX + tx];
+            }
+            if (hit) rasterToCanvas(canvas, s);
+        }
+    }
+
+    // La paleta conserva los colores de figuras quitadas; si se lleno, los
+    // colores nuevos caen en el mas parecido y la imagen ya no es la de una
+    // exportacion completa
+    if (canvas.indexed && canvas.palette.size == 256) return false;
+
+    // Cada fila de cada bloque es un rango contiguo del archivo
+    FILE *f = fopen(filename.c_str(), "r+b");
+    if (!f) return false;
+    unsigned char line[TILE * 3];
+    size_t written = 0;
+    bool ok = true;
+    for (int ty = 0; ty < canvas.tilesY && ok; ty++) {
+        for (int tx = 0; tx < canvas.tilesX && ok; tx++) {
+            if (!dirty[(size_t) ty * canvas.tilesX + tx]) continue;
+            for (int y = ty * TILE; y < min((ty + 1) * TILE, canvas.h) && ok; y++) {
+                int cnt = canvas.rowPart(y, tx, line);
+                long long off = (long long) header.size() + 3LL * ((long long) (canvas.h - 1 - y) * canvas.w + tx * TILE);
+                ok = seekFile(f, off, SEEK_SET) && fwrite(line, 3, cnt, f) == (size_t) cnt;
+                written += 3 * cnt;
+            }
+        }
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        cout << "Error al parchear " << filename << ", se exporta completo" << endl;
+        return false;
+    }
+
+    le.scene = scene;
+    le.palette = canvas.palette;
+    cout << "Exportado " << filename << " (incremental: " << n << " de " << dirty.size()
+         << " bloques, " << written / 1024 << " KB escritos)" << endl;
+    return true;
+}
+
+// ---------------- Exportacion por filas de bloques ----------------
+// Ningun formato necesita el lienzo entero: cada figura se anota en las filas de bloques que toca su caja y una fila de
+// bloques se pinta cuando el escritor pide su primera fila y se libera
+// cuando ya se escribieron todas. En memoria quedan las filas de bloques
+// en uso (varias en QOI, que codifica franjas en paralelo) y las listas de
+// figuras.
+struct StreamCanvas {
+    TiledCanvas cv;
+    vector<vector<const Shape *>> bands;   // figuras por fila de bloques, en orden de pintado
+    vector<int> pending;                    // filas sin escribir de cada fila de bloques
+    vector<char> painted;
+    size_t peak = 0;                        // maximo de bloques reservados a la vez
+    mutex m;
+
+    StreamCanvas(const ShapeList &v, const vector<int> &order, bool indexed, int w, int h) {
+        cv.indexed = indexed;
+        cv.resize(w, h);
+        bands.resize(cv.tilesY);
+        painted.assign(cv.tilesY, 0);
+        pending.resize(cv.tilesY);
+        for (int ty = 0; ty < cv.tilesY; ty++) pending[ty] = min(TILE, h - ty * TILE);
+
+        // Los colores entran a la paleta en el orden de pintado, como en el
+        // lienzo entero, y antes de escribir la cabecera del BMP
+        for (int li : order) {
+            for (auto &s : v) {
+                int x0, y0, x1, y1;
+                if (s.layer != li || !boxTiles(shapeBox(s), cv, x0, y0, x1, y1)) continue;
+                if (indexed) {
+                    unsigned char rgb[3];
+                    shapeRGB(s, rgb);
+                    cv.palette.index(rgb);
+                }
+                for (int ty = y0; ty <= y1; ty++) bands[ty].push_back(&s);
+            }
+        }
+    }
+
+    // Fila y en RGB o en indices. La llaman varios hilos a la vez en QOI;
+    // solo pintar y liberar bloques pasa con el candado.
+    void row(int y, bool index, unsigned char *out) {
+        int ty = y / TILE;
+        {
+            lock_guard<mutex> lk(m);
+            if (!painted[ty]) {
+                for (const Shape *s : bands[ty]) rasterToCanvas(cv, *s, ty * TILE, (ty + 1) * TILE);
+                vector<const Shape *>().swap(bands[ty]);
+                painted[ty] = 1;
+                peak = max(peak, cv.allocated);
+            }
+        }
+        if (index) cv.indexRow(y, out);
+        else cv.row(y, out);
+
+        lock_guard<mutex> lk(m);
+        if (--pending[ty] == 0) {
+            for (int tx = 0; tx < cv.tilesX; tx++) cv.dropTile((size_t) ty * cv.tilesX + tx);
+        }
+    }
+};
+
+// Exporta el lienzo completo (sin grid ni ejes), pintado y escrito por
+// filas de bloques
+void exportCanvas(const string &filename) {
+    shared_ptr<const SceneSnapshot> scene = atomic_load(&latestScene);
+
+    bool bmp = hasExtension(filename, ".bmp");
+    bool ppm = !bmp && !hasExtension(filename, ".qoi");
+    if (ppm && exportIncremental(filename, scene)) return;
+
+    // BMP siempre se escribe indexado
+    StreamCanvas sc(scene->shapes, visibleOrder(), indexedCanvas || bmp, canvasW, canvasH);
+    TiledCanvas &cv = sc.cv;
+    bool ok;
+    if (bmp) {
+        FILE *f = fopen(filename.c_str(), "wb");
+        auto rows = [&](int y, unsigned char *out) { sc.row(cv.h - 1 - y, true, out); };
+        ok = f && writeBMP8(f, cv.w, cv.h, cv.palette.colors, cv.palette.size, rows);
+        ok = f && fclose(f) == 0 && ok;
+        if (!ok) cout << "Error al escribir " << filename << endl;
+    }
+    else {
+        auto rows = [&](int y, unsigned char *out) { sc.row(cv.h - 1 - y, false, out); };
+        ok = writeImage(filename, cv.w, cv.h, rows);
+    }
+    if (ok) {
+        cout << "Exportado " << filename << " (" << cv.w << "x" << cv.h << ", como maximo "
+             << sc.peak << " bloques en memoria, " << sc.peak * TILE * TILE * cv.bpp() / 1024 << " KB";
+        if (cv.indexed) cout << ", " << cv.palette.size << " colores";
+        cout << ")" << endl;
+    }
+
+    // De un PPM se guarda con que escena se hizo para la proxima exportacion
+    if (!ppm) return;
+    if (ok) {
+        lastExport.file = filename;
+        lastExport.w = cv.w;
+        lastExport.h = cv.h;
+        lastExport.indexed = cv.indexed;
+        lastExport.palette = cv.palette;
+        lastExport.order = visibleOrder();
+        lastExport.scene = scene;
+    }
+    else lastExport.scene = NULL;
+}
+
+// ---------------- Regresion con imagenes de referencia ----------------
+// --golden archivo rasteriza en memoria (sin ventana ni OpenGL) un conjunto
+// fijo de escenas, una por algoritmo, y compara el hash FNV-1a de cada
+// imagen con lo guardado en el archivo. Los hashes estan en golden.txt
+// junto al codigo; sin el archivo la regresion falla, salvo con
+// --golden-update, que lo escribe de nuevo completo. Las escenas nuevas que
+// no estan en el archivo se agregan al final sin tocar las existentes.
+// Formato: una linea "escena hash" por escena.
+//
+// Los tiempos dependen de la maquina y de la compilacion, asi que no van
+// en el repositorio: se comparan con archivo.<compilacion>.local (por
+// ejemplo golden.txt.release.local), una linea "escena ms" por escena. Una
+// escena sin tiempo local toma el de esta corrida como base.
+
+// Generador pseudoaleatorio propio (splitmix64) para que las escenas sean
+// iguales en cualquier compilador
+struct Rng {
+    unsigned long long s;
+
+    unsigned long long next() {
+        unsigned long long z = (s += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // Entero en [lo, hi]
+    int range(int lo, int hi) {
+        return lo + (int) (next() % (unsigned long long) (hi - lo + 1));
+    }
+};
+
+const int GOLDEN_SIZE = 512;
+const double GOLDEN_NOISE_MS = 0.05;   // diferencias de tiempo menores son ruido
+
+#if defined(CAD_ALLOC_CHECK)
+const char *GOLDEN_BUILD = "check";
+#elif defined(__OPTIMIZE__)
+const char *GOLDEN_BUILD = "release";
+#else
+const char *GOLDEN_BUILD = "debug";
+#endif
+
+struct GoldenScene {
+    const char *name;
+    vector<Shape> shapes;
+    bool fill;            // al final se rellena desde el centro
+};
+
+vector<GoldenScene> goldenScenes() {
+    Rng rng{42};
+    auto shape = [&](Tool t, int th) {
+        Shape s{};
+        s.type = t;
+        s.thickness = th;
+        s.color = {rng.range(0, 255) / 255.0f, rng.range(0, 255) / 255.0f, rng.range(0, 255) / 255.0f};
+        return s;
+    };
+
+    vector<GoldenScene> v;
+    for (Tool t : {LINE_DIRECT, LINE_DDA}) {
+        // Abanico con todas las pendientes y lineas al azar
+        GoldenScene g{t == LINE_DIRECT ? "linea-directa" : "linea-dda", {}, false};
+        for (int a = 0; a < 360; a += 3) {
+            Shape s = shape(t, 1);
+            s.x1 = 256;
+            s.y1 = 256;
+            s.x2 = 256 + roundi(240 * cos(a * M_PI / 180));
+            s.y2 = 256 + roundi(240 * sin(a * M_PI / 180));
+            g.shapes.push_back(s);
+        }
+        for (int i = 0; i < 300; i++) {
+            Shape s = shape(t, 1);
+            s.x1 = rng.range(-20, 531);
+            s.y1 = rng.range(-20, 531);
+            s.x2 = rng.range(-20, 531);
+            s.y2 = rng.range(-20, 531);
+            g.shapes.push_back(s);
+        }
+        v.push_back(g);
+    }
+
+    GoldenScene c{"circulo-pm", {}, false};
+    for (int r = 0; r < 250; r += 2) {
+        Shape s = shape(CIRCLE_PM, 1);
+        s.xc = 256 + rng.range(-8, 8);
+        s.yc = 256 + rng.range(-8, 8);
+        s.r = r;
+        c.shapes.push_back(s);
+    }
+    v.push_back(c);
+
+    GoldenScene e{"elipse-pm", {}, false};
+    for (int i = 0; i < 200; i++) {
+        Shape s = shape(ELLIPSE_PM, 1);
+        s.xc = rng.range(0, 511);
+        s.yc = rng.range(0, 511);
+        s.rx = rng.range(0, 200);
+        s.ry = rng.range(0, 200);
+        e.shapes.push_back(s);
+    }
+    v.push_back(e);
+
+    GoldenScene b{"bezier-afd", {}, false};
+    for (int i = 0; i < 150; i++) {
+        Shape s = shape(BEZIER_AFD, 1);
+        s.x1 = rng.range(0, 511); s.y1 = rng.range(0, 511);
+        s.cx1 = rng.range(-200, 711); s.cy1 = rng.range(-200, 711);
+        s.cx2 = rng.range(-200, 711); s.cy2 = rng.range(-200, 711);
+        s.x2 = rng.range(0, 511); s.y2 = rng.range(0, 511);
+        b.shapes.push_back(s);
+    }
+    v.push_back(b);
+
+    // Todos los tipos con grosor y un relleno al final
+    GoldenScene m{"mixta-relleno", {}, true};
+    for (int i = 0; i < 120; i++) {
+        Tool t = (Tool) rng.range(LINE_DIRECT, ELLIPSE_PM);
+        Shape s = shape(t, rng.range(1, 6));
+        s.x1 = rng.range(0, 511); s.y1 = rng.range(0, 511);
+        s.x2 = rng.range(0, 511); s.y2 = rng.range(0, 511);
+        s.xc = s.x1; s.yc = s.y1;
+        s.r = rng.range(0, 120);
+        s.rx = rng.range(0, 120);
+        s.ry = rng.range(0, 120);
+        m.shapes.push_back(s);
+    }
+    v.push_back(m);
+
+    // Las mismas lineas que linea-dda, con la variante en punto fijo
+    GoldenScene fx{"linea-dda-fija", v[1].shapes, false};
+    for (auto &s : fx.shapes) s.type = LINE_DDA_FIXED;
+    v.push_back(fx);
+
+    // Figuras repetidas: circulo de agujeros, rayado y rejilla de elipses
+    GoldenScene rp{"repeticiones", {}, false};
+    Shape hole = shape(CIRCLE_PM, 2);
+    hole.xc = 128; hole.yc = 128; hole.r = 10;
+    hole.offsets = ringOffsets(12, 90);
+    rp.shapes.push_back(hole);
+    Shape hatch = shape(LINE_DDA_FIXED, 1);
+    hatch.x1 = 280; hatch.y1 = 20; hatch.x2 = 380; hatch.y2 = 120;
+    hatch.offsets = gridOffsets(12, 1, 10, 0);
+    rp.shapes.push_back(hatch);
+    Shape dot = shape(ELLIPSE_PM, 1);
+    dot.xc = 40; dot.yc = 280; dot.rx = 12; dot.ry = 7;
+    dot.offsets = gridOffsets(16, 8, 28, 28);
+    rp.shapes.push_back(dot);
+    Shape arc = shape(BEZIER_AFD, 3);
+    arc.x1 = -30; arc.y1 = 500; arc.cx1 = 0; arc.cy1 = 440;
+    arc.cx2 = 40; arc.cy2 = 560; arc.x2 = 70; arc.y2 = 500;
+    arc.offsets = gridOffsets(8, 1, 80, 0);
+    rp.shapes.push_back(arc);
+    v.push_back(rp);
+    return v;
+}
+
+// Relleno por software sobre el lienzo, igual que computeFill sobre el
+// framebuffer
+shared_ptr<const vector<Span>> goldenFill(const TiledCanvas &cv, int sx, int sy) {
+    vector<unsigned int> px((size_t) cv.w * cv.h);
+    vector<unsigned char> line(3 * (size_t) cv.w);
+    for (int y = 0; y < cv.h; y++) {
+        cv.row(y, line.data());
+        for (int x = 0; x < cv.w; x++) {
+            unsigned char rgba[4] = {line[3 * x], line[3 * x + 1], line[3 * x + 2], 255};
+            memcpy(&px[(size_t) y * cv.w + x], rgba, 4);
+        }
+    }
+    SpanBuf &out = framePool.spanBuf();
+    floodFillSpans(px.data(), cv.w, cv.h, sx, sy, 0xFF00FFFFu, out);
+    auto sp = make_shared<vector<Span>>(out.begin(), out.end());
+    framePool.reset();
+    return sp;
+}
+
+unsigned long long hashCanvas(const TiledCanvas &cv) {
+    unsigned long long h = 0xCBF29CE484222325ull;
+    vector<unsigned char> line(3 * (size_t) cv.w);
+    for (int y = 0; y < cv.h; y++) {
+        cv.row(y, line.data());
+        for (unsigned char b : line) {
+            h ^= b;
+            h *= 0x100000001B3ull;
+        }
+    }
+    return h;
+}
+
+// Tiempo del algoritmo solo (sin lienzo) por pasada sobre la escena:
+// mediana de 5 muestras de al menos 20 ms cada una, despues de una de
+// calentamiento. Una figura repetida se rasteriza una vez y sus pixeles se
+// desplazan a cada copia, como al dibujarla.
+double goldenTime(const GoldenScene &g, const TiledCanvas &cv) {
+    vector<double> samples;
+    vector<Point> pts;
+    long long sum = 0;
+    for (int k = 0; k < 6; k++) {
+        auto t0 = chrono::steady_clock::now();
+        int passes = 0;
+        double ms;
+        do {
+            for (const Shape &s : g.shapes) {
+                if (!s.offsets) {
+                    auto put = [&](int x, int y) { sum += x ^ y; };
+                    rasterShape(s, put);
+                    continue;
+                }
+                pts.clear();
+                auto put = [&](int x, int y) { pts.push_back({x, y}); };
+                rasterShape(s, put);
+                forInstances(s, [&](int dx, int dy) {
+                    for (const Point &p : pts) sum += (p.x + dx) ^ (p.y + dy);
+                });
+            }
+            if (g.fill) goldenFill(cv, GOLDEN_SIZE / 2, GOLDEN_SIZE / 2);
+            passes++;
+            ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        } while (ms < 20);
+        if (k > 0) samples.push_back(ms / passes);
+    }
+    if (sum == 42) cout << "";   // que el compilador no descarte el trabajo
+    sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Devuelve el codigo de salida: 0 si todo coincide
+int runGolden(const string &file, bool update, double tolerance) {
+    string localFile = file + "." + GOLDEN_BUILD + ".local";
+    unordered_map<string, unsigned long long> hashes;
+    unordered_map<string, double> times;
+    {
+        ifstream in(file);
+        string name;
+        unsigned long long h;
+        while (in >> name >> hex >> h >> dec) hashes[name] = h;
+    }
+    {
+        ifstream in(localFile);
+        string name;
+        double ms;
+        while (in >> name >> ms) times[name] = ms;
+    }
+    if (hashes.empty() && !update) {
+        cout << "No hay referencias en " << file << " (usar --golden-update para crearlas)" << endl;
+        return 1;
+    }
+
+    int failures = 0;
+    vector<string> added;
+    bool newTimes = update;
+    for (const GoldenScene &g : goldenScenes()) {
+        TiledCanvas cv;
+        cv.resize(GOLDEN_SIZE, GOLDEN_SIZE);
+        for (const Shape &s : g.shapes) rasterToCanvas(cv, s);
+        if (g.fill) {
+            Shape f{};
+            f.type = FILL_SCAN;
+            f.color = {1, 0, 1};
+            f.thickness = 1;
+            f.spans = goldenFill(cv, GOLDEN_SIZE / 2, GOLDEN_SIZE / 2);
+            rasterToCanvas(cv, f);
+        }
+        unsigned long long h = hashCanvas(cv);
+        double ms = goldenTime(g, cv);
+
+        if (update) {
+            hashes[g.name] = h;
+            times[g.name] = ms;
+            cout << "GUARDADA " << g.name << " " << hex << h << dec << " " << ms << " ms" << endl;
+            continue;
+        }
+
+        auto it = hashes.find(g.name);
+        if (it == hashes.end()) {
+            hashes[g.name] = h;
+            times[g.name] = ms;
+            added.push_back(g.name);
+            newTimes = true;
+            cout << "AGREGADA " << g.name << " " << hex << h << dec << " " << ms << " ms" << endl;
+            continue;
+        }
+
+        auto t = times.find(g.name);
+        bool hasBase = t != times.end();
+        double base = hasBase ? t->second : ms;
+        if (!hasBase) {
+            times[g.name] = ms;
+            newTimes = true;
+        }
+
+        const char *st = "OK";
+        if (it->second != h) st = "FALLA (pixeles)";
+        else if (ms > base * (1 + tolerance / 100) + GOLDEN_NOISE_MS) {
+            // Una medicion lenta se repite antes de darla por regresion
+            ms = min(ms, goldenTime(g, cv));
+            if (ms > base * (1 + tolerance / 100) + GOLDEN_NOISE_MS) st = "FALLA (tiempo)";
+        }
+        if (strcmp(st, "OK") != 0) failures++;
+
+        cout << st << " " << g.name << " " << hex << h << dec << " " << ms << " ms";
+        if (hasBase) cout << " (base " << base << " ms)" << endl;
+        else cout << " (base nueva)" << endl;
+    }
+
+    if (update) {
+        ofstream out(file);
+        for (const GoldenScene &g : goldenScenes()) out << g.name << " " << hex << hashes[g.name] << dec << "\n";
+        if (!out) {
+            cout << "No se pudieron escribir las referencias en " << file << endl;
+            failures++;
+        }
+        else cout << "Referencias escritas en " << file << endl;
+    }
+    if (!added.empty()) {
+        ofstream out(file, ios::app);
+        for (const string &n : added) out << n << " " << hex << hashes[n] << dec << "\n";
+        if (!out) {
+            cout << "No se pudieron agregar referencias a " << file << endl;
+            failures++;
+        }
+    }
+    if (newTimes) {
+        ofstream out(localFile);
+        for (const GoldenScene &g : goldenScenes()) {
+            auto t = times.find(g.name);
+            if (t != times.end()) out << g.name << " " << t->second << "\n";
+        }
+        if (!out) {
+            cout << "No se pudieron escribir los tiempos en " << localFile << endl;
+            failures++;
+        }
+        else cout << "Tiempos base escritos en " << localFile << endl;
+    }
+    if (update) return failures ? 1 : 0;
+    cout << (failures ? "Regresion: " : "Sin regresiones: ") << failures << " fallas" << endl;
+    return failures ? 1 : 0;
+}
+
+// ---------------- Generador de escenas ----------------
+// Escenas sinteticas reproducibles para medir como escalan el redibujado,
+// deshacer, exportar y la memoria. Con --generate N se agregan al iniciar
+// (un solo paso de deshacer); con --generate-out archivo se escribe un
+// snapshot sin abrir ventana, que se usa copiandolo a canvas.snap.
+const int GEN_KINDS = 6;
+
+struct GenOptions {
+    long long count = 0;
+    unsigned long long seed = 1;
+    int weights[GEN_KINDS] = {1, 1, 1, 1, 1, 0};   // directa, dda, circulo, elipse, bezier, dda fija
+    int minSize = 2, maxSize = 200;     // largo, diametro o ancho de la caja
+    bool logSizes = false;              // muchas chicas y pocas grandes
+    int minThick = 1, maxThick = 1;
+    int colors = 0;                     // tamano de la paleta; 0 = al azar
+    int layers = 1;
+};
+
+const Tool GEN_TOOLS[GEN_KINDS] = {LINE_DIRECT, LINE_DDA, CIRCLE_PM, ELLIPSE_PM, BEZIER_AFD, LINE_DDA_FIXED};
+
+// "line:3,dda:1,circle:2,ellipse:1,bezier:0,ddafix:1"; los tipos que no
+// aparecen quedan con peso 0
+bool parseMix(const string &s, GenOptions &o) {
+    static const char *names[GEN_KINDS] = {"line", "dda", "circle", "ellipse", "bezier", "ddafix"};
+    int w[GEN_KINDS] = {0, 0, 0, 0, 0, 0};
+    size_t p = 0;
+    while (p < s.size()) {
+        size_t q = s.find(',', p);
+        if (q == string::npos) q = s.size();
+        string item = s.substr(p, q - p);
+        size_t c = item.find(':');
+        int k = 0;
+        while (k < GEN_KINDS && item.substr(0, c) != names[k]) k++;
+        if (k == GEN_KINDS) return false;
+        if (c == string::npos) w[k] = 1;
+        else {
+            // Solo enteros sin signo; un peso negativo o con basura es error
+            const char *num = item.c_str() + c + 1;
+            char *end;
+            long v = strtol(num, &end, 10);
+            if (end == num || *end || *num == '-' || v > 1000000) return false;
+            w[k] = (int) v;
+        }
+        p = q + 1;
+    }
+    int total = 0;
+    for (int k = 0; k < GEN_KINDS; k++) total += w[k];
+    if (total <= 0) return false;
+    memcpy(o.weights, w, sizeof w);
+    return true;
+}
+
+// "a-b" o "a"
+bool parseRange(const char *s, int &lo, int &hi) {
+    int n = sscanf(s, "%d-%d", &lo, &hi);
+    if (n == 1) hi = lo;
+    return n >= 1 && lo >= 0 && hi >= lo;
+}
+
+struct ShapeGenerator {
+    const GenOptions &o;
+    int w, h;
+    Rng rng;
+    vector<Color> palette;
+    int totalWeight;
+
+    ShapeGenerator(const GenOptions &opt, int cw, int ch) : o(opt), w(cw), h(ch), rng{opt.seed} {
+        for (int i = 0; i < o.colors; i++) palette.push_back(randomColor());
+        totalWeight = 0;
+        for (int k = 0; k < GEN_KINDS; k++) totalWeight += o.weights[k];
+    }
+
+    Color randomColor() {
+        return {rng.range(0, 255) / 255.0f, rng.range(0, 255) / 255.0f, rng.range(0, 255) / 255.0f};
+    }
+
+    int size() {
+        if (!o.logSizes || o.minSize == o.maxSize) return rng.range(o.minSize, o.maxSize);
+        double a = log(max(o.minSize, 1)), b = log(o.maxSize);
+        return (int) exp(a + (b - a) * (rng.next() >> 11) * (1.0 / (1ull << 53)));
+    }
+
+    Shape next() {
+        int pick = rng.range(0, totalWeight - 1), k = 0;
+        while (pick >= o.weights[k]) pick -= o.weights[k++];
+
+        Shape s{};
+        s.type = GEN_TOOLS[k];
+        s.thickness = rng.range(o.minThick, o.maxThick);
+        s.color = palette.empty() ? randomColor() : palette[rng.range(0, (int) palette.size() - 1)];
+        s.layer = rng.range(0, o.layers - 1);
+
+        int cx = rng.range(0, w - 1), cy = rng.range(0, h - 1);
+        int d = size();
+        if (isLine(s.type)) {
+            double a = rng.range(0, 35999) * M_PI / 18000;
+            s.x1 = cx;
+            s.y1 = cy;
+            s.x2 = cx + roundi(d * cos(a));
+            s.y2 = cy + roundi(d * sin(a));
+        }
+        else if (s.type == CIRCLE_PM) {
+            s.xc = cx;
+            s.yc = cy;
+            s.r = d / 2;
+        }
+        else if (s.type == ELLIPSE_PM) {
+            s.xc = cx;
+            s.yc = cy;
+            s.rx = rng.range(0, d / 2);
+            s.ry = rng.range(0, d / 2);
+        }
+        else {
+            s.x1 = cx; s.y1 = cy;
+            s.cx1 = cx + rng.range(-d, d); s.cy1 = cy + rng.range(-d, d);
+            s.cx2 = cx + rng.range(-d, d); s.cy2 = cy + rng.range(-d, d);
+            s.x2 = cx + rng.range(-d, d); s.y2 = cy + rng.range(-d, d);
+        }
+        return s;
+    }
+};
+
+void generateShapes(const GenOptions &o, int w, int h, vector<Shape> &out) {
+    ShapeGenerator g(o, w, h);
+    out.reserve(out.size() + o.count);
+    for (long long i = 0; i < o.count; i++) out.push_back(g.next());
+}
+
+// Escribe el snapshot figura por figura, sin tener la escena en memoria
+bool writeGeneratedScene(const GenOptions &o, int w, int h, const string &file) {
+    string tmp = file + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+
+    ShapeGenerator g(o, w, h);
+    ByteWriter bw;
+    bool ok = fwrite("CADS", 1, 4, f) == 4;
+    bw.u8(JOURNAL_VERSION);
+    bw.u32(0);
+    bw.var(1);         // un solo estado, la escena, sin deshacer ni rehacer
+    bw.var(0);
+    bw.var(0);         // sin padre
+    bw.var(0);
+    bw.var(o.count);
+    for (long long i = 0; i < o.count && ok; i++) {
+        putShape(bw, g.next());
+        if (bw.b.size() >= (1 << 20)) {
+            ok = fwrite(bw.b.data(), 1, bw.b.size(), f) == bw.b.size();
+            bw.b.clear();
+        }
+    }
+    ok = ok && fwrite(bw.b.data(), 1, bw.b.size(), f) == bw.b.size();
+    ok = syncFile(f) && ok;
+    ok = fclose(f) == 0 && ok;
+
+    return ok && replaceFile(tmp.c_str(), file.c_str());
+}
+
+// ---------------- Estadisticas de cobertura ----------------
+// Pixeles que cubre cada figura dentro del lienzo y pares de figuras que
+// comparten pixeles (por ejemplo para estimar tinta al imprimir). Se usan
+// los mismos tramos que al dibujar. Los pares candidatos salen de una
+// rejilla de celdas por caja y solo se cruzan los tramos de las filas en
+// que las cajas se tocan. Figuras y celdas se reparten entre hilos.
+const int STATS_CELL = 64;
+
+struct ShapeCover {
+    SpanTable spans;      // ordenados por fila y columna, sin solaparse
+    int dx, dy;
+    Box box;              // caja de los pixeles dentro del lienzo
+    long long pixels;
+};
+
+struct OverlapPair {
+    size_t a, b;          // posiciones en la lista, a < b
+    long long pixels;
+};
+
+struct CoverageReport {
+    vector<const Shape *> shapes;
+    vector<long long> pixels;       // por figura
+    vector<OverlapPair> overlaps;   // ordenados por (a, b)
+    size_t candidates = 0;          // pares con cajas que se tocan
+};
+
+// Llama f(hilo, i) para i en [0, n), repartiendo bloques entre los hilos
+template <class F>
+void parallelFor(size_t n, F f) {
+    int workers = max(1u, thread::hardware_concurrency());
+    atomic<size_t> next(0);
+    vector<thread> pool;
+    for (int k = 0; k < workers; k++) {
+        pool.emplace_back([&, k]() {
+            for (size_t i; (i = next.fetch_add(64)) < n;) {
+                for (size_t j = i; j < min(n, i + 64); j++) f(k, j);
+            }
+        });
+    }
+    for (auto &t : pool) t.join();
+}
+
+ShapeCover coverOf(const Shape &s, int w, int h) {
+    PlacedSpans p = shapeSpans(s);
+
+    // Los rellenos no vienen ordenados y las copias de una figura repetida
+    // se pueden pisar: se juntan en una sola lista para no contar dos veces
+    if (s.type == FILL_SCAN || s.offsets) {
+        vector<Span> raw;
+        forInstances(s, [&](int dx, int dy) {
+            for (const Span &sp : *p.spans) {
+                int y = sp.y + p.dy + dy;
+                if (y >= 0 && y < h) raw.push_back({y, sp.x + p.dx + dx, sp.len});
+            }
+        });
+        auto out = make_shared<vector<Span>>();
+        mergeSpans(raw, *out);
+        p = {out, 0, 0};
+    }
+
+    ShapeCover c{p.spans, p.dx, p.dy, {INT_MAX, INT_MAX, INT_MIN, INT_MIN}, 0};
+    for (const Span &sp : *p.spans) {
+        int y = sp.y + p.dy;
+        int x0 = max(sp.x + p.dx, 0);
+        int x1 = min(sp.x + p.dx + sp.len, w);
+        if (y < 0 || y >= h || x1 <= x0) continue;
+        c.pixels += x1 - x0;
+        c.box = {min(c.box.x0, x0), min(c.box.y0, y), max(c.box.x1, x1 - 1), max(c.box.y1, y)};
+    }
+    return c;
+}
+
+// Pixeles que comparten dos figuras dentro de la caja q
+long long overlapPixels(const ShapeCover &a, const ShapeCover &b, const Box &q) {
+    auto byRow = [](const Span &s, int y) { return s.y < y; };
+    auto ia = lower_bound(a.spans->begin(), a.spans->end(), q.y0 - a.dy, byRow);
+    auto ib = lower_bound(b.spans->begin(), b.spans->end(), q.y0 - b.dy, byRow);
+    long long n = 0;
+
+    while (ia != a.spans->end() && ib != b.spans->end()) {
+        int ya = ia->y + a.dy;
+        int yb = ib->y + b.dy;
+        if (ya > q.y1 || yb > q.y1) break;
+        if (ya != yb) {
+            if (ya < yb) ++ia;
+            else ++ib;
+            continue;
+        }
+        int a0 = ia->x + a.dx, a1 = a0 + ia->len;
+        int b0 = ib->x + b.dx, b1 = b0 + ib->len;
+        int lo = max(max(a0, b0), q.x0);
+        int hi = min(min(a1, b1), q.x1 + 1);
+        if (hi > lo) n += hi - lo;
+        if (a1 < b1) ++ia;
+        else ++ib;
+    }
+    return n;
+}
+
+// Cobertura de las figuras de las capas visibles; con pairs tambien los
+// solapes entre ellas
+CoverageReport coverageStats(const ShapeList &v, const vector<char> &visible, int w, int h, bool pairs) {
+    CoverageReport r;
+    for (auto &s : v) {
+        if (s.layer >= (int) visible.size() || visible[s.layer]) r.shapes.push_back(&s);
+    }
+    size_t n = r.shapes.size();
+
+    vector<ShapeCover> cover(n);
+    parallelFor(n, [&](int, size_t i) { cover[i] = coverOf(*r.shapes[i], w, h); });
+    r.pixels.resize(n);
+    for (size_t i = 0; i < n; i++) r.pixels[i] = cover[i].pixels;
+    if (!pairs) return r;
+
+    // Cada celda guarda las figuras cuya caja la toca, en orden de escena
+    int cw = (w + STATS_CELL - 1) / STATS_CELL;
+    int ch = (h + STATS_CELL - 1) / STATS_CELL;
+    vector<vector<int>> cells((size_t) cw * ch);
+    for (size_t i = 0; i < n; i++) {
+        const Box &b = cover[i].box;
+        if (!cover[i].pixels) continue;
+        for (int cy = b.y0 / STATS_CELL; cy <= b.y1 / STATS_CELL; cy++) {
+            for (int cx = b.x0 / STATS_CELL; cx <= b.x1 / STATS_CELL; cx++) cells[(size_t) cy * cw + cx].push_back((int) i);
+        }
+    }
+
+    // Un par se compara solo en la celda de la esquina inferior izquierda
+    // de la interseccion de sus cajas, asi aparece una sola vez
+    int workers = max(1u, thread::hardware_concurrency());
+    vector<vector<OverlapPair>> found(workers);
+    vector<size_t> candidates(workers, 0);
+    parallelFor(cells.size(), [&](int k, size_t c) {
+        vector<int> list = cells[c];
+        int cx = (int) (c % cw), cy = (int) (c / cw);
+        sort(list.begin(), list.end(), [&](int i, int j) { return cover[i].box.x0 < cover[j].box.x0; });
+        for (size_t p = 0; p < list.size(); p++) {
+            const Box &a = cover[list[p]].box;
+            for (size_t q = p + 1; q < list.size() && cover[list[q]].box.x0 <= a.x1; q++) {
+                const Box &b = cover[list[q]].box;
+                Box i = {max(a.x0, b.x0), max(a.y0, b.y0), min(a.x1, b.x1), min(a.y1, b.y1)};
+                if (i.y0 > i.y1 || i.x0 / STATS_CELL != cx || i.y0 / STATS_CELL != cy) continue;
+                candidates[k]++;
+                size_t s0 = min(list[p], list[q]), s1 = max(list[p], list[q]);
+                long long px = overlapPixels(cover[s0], cover[s1], i);
+                if (px > 0) found[k].push_back({s0, s1, px});
+            }
+        }
+    });
+
+    for (int k = 0; k < workers; k++) {
+        r.candidates += candidates[k];
+        r.overlaps.insert(r.overlaps.end(), found[k].begin(), found[k].end());
+    }
+    sort(r.overlaps.begin(), r.overlaps.end(), [](const OverlapPair &x, const OverlapPair &y) {
+        return x.a != y.a ? x.a < y.a : x.b < y.b;
+    });
+    return r;
+}
+
+// Escribe "figura id pixeles" por figura y "solape id_a id_b pixeles" por
+// par, y muestra el resumen
+bool writeCoverage(const string &file, const ShapeList &v, const vector<char> &visible, int w, int h) {
+    auto t0 = chrono::steady_clock::now();
+    CoverageReport r = coverageStats(v, visible, w, h, true);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    FILE *f = fopen(file.c_str(), "w");
+    if (!f) {
+        cout << "No se pudo escribir " << file << endl;
+        return false;
+    }
+    long long total = 0, shared = 0;
+    for (size_t i = 0; i < r.shapes.size(); i++) {
+        fprintf(f, "figura %u %lld\n", r.shapes[i]->id, r.pixels[i]);
+        total += r.pixels[i];
+    }
+    for (auto &p : r.overlaps) {
+        fprintf(f, "solape %u %u %lld\n", r.shapes[p.a]->id, r.shapes[p.b]->id, p.pixels);
+        shared += p.pixels;
+    }
+    bool ok = fclose(f) == 0;
+
+    cout << "Cobertura: " << r.shapes.size() << " figuras, " << total << " pixeles, "
+         << r.candidates << " pares candidatos, " << r.overlaps.size() << " con solape ("
+         << shared << " pixeles compartidos), " << ms << " ms -> " << file << endl;
+    return ok;
+}
+
+// ---------------- Recuperacion y compactacion ----------------
+// Las listas comparten bloques, asi que capturar la escena y sus pilas no
+// copia figuras
+struct SceneState {
+    ShapeList shapes;
+    vector<ShapeList> undo, redo;   // de abajo hacia arriba
+};
+
+vector<ShapeList> stackToVector(stack<ShapeList> st) {
+    vector<ShapeList> v(st.size());
+    for (size_t i = v.size(); i-- > 0; st.pop()) v[i] = st.top();
+    return v;
+}
+
+// Formato del snapshot: generacion, cantidad de estados y posicion de la
+// escena entre ellos. Los estados van en orden cronologico (deshacer de
+// abajo hacia arriba, la escena, rehacer de arriba hacia abajo) y cada uno
+// se guarda como "padre, cuantas figuras conserva de el, figuras nuevas".
+// Casi siempre un estado es el anterior mas algunas figuras, asi que el
+// archivo crece con las figuras distintas y no con la suma de los estados.
+bool writeSnapshot(const SceneState &st, unsigned int gen) {
+    vector<const ShapeList *> states;
+    for (auto &v : st.undo) states.push_back(&v);
+    states.push_back(&st.shapes);
+    for (size_t i = st.redo.size(); i-- > 0;) states.push_back(&st.redo[i]);
+
+    ByteWriter w;
+    w.u8(JOURNAL_VERSION);
+    w.u32(gen);
+    w.var(states.size());
+    w.var(st.undo.size());
+    for (size_t i = 0; i < states.size(); i++) {
+        const ShapeList &v = *states[i];
+        size_t keep = 0;
+        if (i > 0) {
+            const ShapeList &p = *states[i - 1];
+            keep = commonPrefix(p.size(), v.size(), [&](size_t k) { return p[k].id == v[k].id; });
+        }
+        w.var(keep ? i : 0);   // 0 es la lista vacia, k el estado k - 1
+        w.var(keep);
+        w.var(v.size() - keep);
+        for (size_t k = keep; k < v.size(); k++) putShape(w, v[k]);
+    }
+
+    FILE *f = fopen(SNAP_TMP_FILE, "wb");
+    if (!f) return false;
+    bool ok = fwrite("CADS", 1, 4, f) == 4;
+    ok = ok && fwrite(w.b.data(), 1, w.b.size(), f) == w.b.size();
+    ok = syncFile(f) && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        remove(SNAP_TMP_FILE);
+        return false;
+    }
+    return replaceFile(SNAP_TMP_FILE, SNAP_FILE);
+}
+
+bool readFile(const char *name, vector<unsigned char> &data) {
+    FILE *f = fopen(name, "rb");
+    if (!f) return false;
+    unsigned char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, f)) > 0) data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return true;
+}
+
+// Carga el snapshot y deja su generacion en gen (0 si no hay). Devuelve
+// false si el archivo existe pero no se puede leer.
+bool loadSnapshot(unsigned int &gen) {
+    gen = 0;
+    vector<unsigned char> data;
+    if (!readFile(SNAP_FILE, data)) return true;
+    if (data.size() < 9 || memcmp(data.data(), "CADS", 4) != 0) return false;
+
+    ByteReader rd{data.data() + 4, data.data() + data.size()};
+    if (rd.u8() != JOURNAL_VERSION) return false;
+    unsigned int g = rd.u32();
+    long long n = rd.var(), cur = rd.var();
+    if (n < 1 || n > rd.e - rd.p || cur < 0 || cur >= n) return false;
+
+    // Un estado que conserva todo su padre lo copia entero: comparte los
+    // bloques y los ids, como en la sesion que lo escribio
+    vector<ShapeList> states(n);
+    for (long long i = 0; i < n; i++) {
+        long long parent = rd.var(), keep = rd.var(), added = rd.var();
+        if (parent < 0 || parent > i || keep < 0 || added < 0 || added > rd.e - rd.p) return false;
+        ShapeList &v = states[i];
+        if (parent > 0) {
+            const ShapeList &p = states[parent - 1];
+            if (keep > (long long) p.size()) return false;
+            if (keep == (long long) p.size()) v = p;
+            else for (long long k = 0; k < keep; k++) v.push_back(p[k]);
+        }
+        else if (keep) return false;
+        for (long long k = 0; k < added; k++) {
+            Shape s;
+            if (!getShape(rd, s)) return false;
+            v.push_back(s);
+        }
+    }
+    if (!rd.ok) return false;
+
+    shapes = states[cur];
+    undo_stack = stack<ShapeList>();
+    redo_stack = stack<ShapeList>();
+    for (long long i = 0; i < cur; i++) undo_stack.push(states[i]);
+    for (long long i = n - 1; i > cur; i--) redo_stack.push(states[i]);
+    shapeIndex.sync(shapes);
+    maxShapeLayer = (int) layers.size() - 1;   // getShape ya creo las capas
+    gen = g;
+    return true;
+}
+
+// Repite un diario si se aplica sobre la generacion gen. Un diario
+// anterior a gen ya esta en el snapshot; uno posterior o ilegible no se
+// puede aplicar y devuelve -1. Se repite hasta el primer registro que no
+// se puede leer (un registro cortado por una caida o datos danados) y
+// partial queda en true si despues de el hay bytes sin aplicar.
+long long replayJournal(const char *name, unsigned int &gen, bool &partial) {
+    partial = false;
+    vector<unsigned char> data;
+    if (!readFile(name, data) || data.size() < 9) return 0;
+    if (memcmp(data.data(), "CADJ", 4) != 0) return -1;
+
+    ByteReader rd{data.data() + 4, data.data() + data.size()};
+    if (rd.u8() != JOURNAL_VERSION) return -1;
+    unsigned int base = rd.u32();
+    if (base < gen) return 0;
+    if (base > gen) return -1;
+
+    long long count = 0;
+    journalReplaying = true;
+    while (rd.p < rd.e && !partial) {
+        int op = rd.u8();
+        if (op == J_ADD) {
+            Shape sh;
+            if (!getShape(rd, sh)) partial = true;
+            else addShape(sh);
+        }
+        else if (op == J_BATCH) {
+            long long n = rd.var();
+            bool ok = n >= 0 && n <= rd.e - rd.p;
+            vector<Shape> v(ok ? n : 0);
+            for (auto &sh : v) {
+                if (!(ok = getShape(rd, sh))) break;
+            }
+            if (!ok) partial = true;
+            else addShapes(v);
+        }
+        else if (op == J_CLEAR) clearShapes();
+        else if (op == J_UNDO) doUndo();
+        else if (op == J_REDO) doRedo();
+        else partial = true;
+        if (!partial) count++;
+    }
+    journalReplaying = false;
+
+    gen = base + 1;
+    return count;
+}
+
+SceneState captureScene() {
+    SceneState st;
+    st.shapes = shapes;
+    st.undo = stackToVector(undo_stack);
+    st.redo = stackToVector(redo_stack);
+    return st;
+}
+
+// Carga el snapshot y repite los diarios sin escribir nada. snapGen queda
+// con la generacion del snapshot, gen con la que sigue a los diarios, n
+// con los cambios repetidos y partial con los diarios que no se leyeron
+// completos; false si algo no se puede leer o aplicar.
+bool recoverScene(unsigned int &snapGen, unsigned int &gen, long long &n, vector<const char *> &partial) {
+    if (!loadSnapshot(gen)) {
+        cout << SNAP_FILE << " esta danado o es de otra version" << endl;
+        return false;
+    }
+    snapGen = gen;
+    n = 0;
+    for (const char *name : {JOURNAL_OLD_FILE, JOURNAL_FILE}) {
+        bool cut;
+        long long m = replayJournal(name, gen, cut);
+        if (m < 0) {
+            cout << "El diario no corresponde a " << SNAP_FILE << endl;
+            return false;
+        }
+        n += m;
+        if (cut) partial.push_back(name);
+    }
+    return true;
+}
+
+// Recupera la escena al iniciar y la junta en un snapshot nuevo
+void journalInit() {
+    if (!journalEnabled) return;
+
+    // Si algo no se puede leer no se toca ningun archivo: el diario queda
+    // desactivado y los datos siguen ahi para recuperarlos a mano
+    unsigned int snapGen, gen;
+    long long n;
+    vector<const char *> partial;
+    if (!recoverScene(snapGen, gen, n, partial)) {
+        cout << "Diario desactivado" << endl;
+        return;
+    }
+
+    journalGen = snapGen;
+    if (n > 0) {
+        cout << "Recuperados " << n << " cambios del diario" << endl;
+        if (!writeSnapshot(captureScene(), gen + 1)) {
+            cout << "No se pudo escribir " << SNAP_FILE << ", diario desactivado" << endl;
+            return;
+        }
+        journalGen = gen + 1;
+    }
+
+    // Lo que quedo sin leer de un diario se aparta antes de empezar otro
+    for (const char *name : partial) {
+        string bad = string(name) + ".bad";
+        cout << name << " tiene registros que no se pudieron leer, se guarda como " << bad << endl;
+        if (!replaceFile(name, bad.c_str())) {
+            cout << "No se pudo renombrar " << name << ", diario desactivado" << endl;
+            return;
+        }
+    }
+    remove(JOURNAL_OLD_FILE);
+    journalFile = openJournal(JOURNAL_FILE, journalGen);
+}
+
+thread compactThread;
+atomic<bool> compactRunning(false);
+
+// Escena de una compactacion cuyo snapshot no se pudo escribir. Mientras
+// este pendiente, canvas.journal.old tiene los unicos registros de esos
+// cambios: no se rota de nuevo y se reintenta el mismo snapshot.
+struct PendingSnapshot {
+    bool pending = false;
+    SceneState st;
+    unsigned int gen = 0;
+};
+
+PendingSnapshot compactPending;   // lo toca el hilo de compactacion o, tras join, el de escena
+
+void writeCompaction() {
+    PendingSnapshot &p = compactPending;
+    if (writeSnapshot(p.st, p.gen)) {
+        remove(JOURNAL_OLD_FILE);
+        p = PendingSnapshot();
+    }
+    else {
+        cout << "No se pudo escribir " << SNAP_FILE << ", se reintenta en la proxima compactacion" << endl;
+    }
+    compactRunning = false;
+}
+
+// Compactacion en segundo plano: el diario actual pasa a .old, se abre
+// uno nuevo y un hilo escribe el snapshot con una copia de la escena.
+void startCompaction() {
+    if (!journalFile || compactRunning) return;
+    if (compactThread.joinable()) compactThread.join();
+
+    compactRunning = true;
+    if (compactPending.pending) {
+        compactThread = thread(writeCompaction);
+        return;
+    }
+
+    syncFile(journalFile);
+    fclose(journalFile);
+    if (!replaceFile(JOURNAL_FILE, JOURNAL_OLD_FILE)) {
+        // Sin rotar se sigue escribiendo al final del mismo diario
+        journalFile = fopen(JOURNAL_FILE, "ab");
+        compactRunning = false;
+        return;
+    }
+    journalGen++;
+    journalFile = openJournal(JOURNAL_FILE, journalGen);
+    journalDirty = false;
+
+    compactPending.pending = true;
+    compactPending.st = captureScene();
+    compactPending.gen = journalGen;
+    compactThread = thread(writeCompaction);
+}
+
+// Lo llama el hilo de escena: fsync si hubo cambios y compactacion si el
+// diario crecio
+void journalTick() {
+    if (journalFile && journalDirty) {
+        syncFile(journalFile);
+        journalDirty = false;
+        if (ftell(journalFile) > COMPACT_BYTES) startCompaction();
+    }
+}
+
+void journalClose() {
+    if (compactThread.joinable()) compactThread.join();
+    if (journalFile) {
+        syncFile(journalFile);
+        fclose(journalFile);
+        journalFile = NULL;
+    }
+}
+
+// ---------------- Planificador de redibujado ----------------
+// Los cambios piden redibujar con invalidate(); los pedidos se juntan
+// (sus motivos) y se dibuja como maximo un frame por intervalo. Cada frame
+// vuelve a componer toda la vista desde las listas de las capas.
+enum RedrawReason {
+    R_SCENE = 1,
+    R_VIEW = 2,
+    R_LAYERS = 4,
+    R_SELECTION = 8
+};
+
+const double FRAME_MS = 1000.0 / 60;
+
+struct RedrawScheduler {
+    unsigned int reasons = 0;
+    bool scheduled = false;
+    chrono::steady_clock::time_point lastFrame;
+
+    size_t requests = 0;
+    size_t frames = 0;
+    size_t missed = 0;
+    double worstMs = 0;
+};
+
+RedrawScheduler sched;
+
+double msSince(chrono::steady_clock::time_point t) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t).count();
+}
+
+string reasonNames(unsigned int r) {
+    static const char *names[] = {"escena", "vista", "capas", "seleccion"};
+    string out;
+    for (int i = 0; i < 4; i++) {
+        if (r & (1u << i)) out += (out.empty() ? "" : "+") + string(names[i]);
+    }
+    return out.empty() ? "ventana" : out;
+}
+
+// Si un repintado de la ventana ya dibujo los cambios no hay frame
+void frameTimer(int) {
+    sched.scheduled = false;
+    if (sched.reasons) glutPostRedisplay();
+}
+
+// Pide redibujar por los motivos r
+void invalidate(unsigned int r) {
+    if (!r) return;
+    sched.requests++;
+    sched.reasons |= r;
+
+    if (!sched.scheduled) {
+        sched.scheduled = true;
+        int wait = sched.frames ? max(0, (int) (FRAME_MS - msSince(sched.lastFrame))) : 0;
+        glutTimerFunc(wait, frameTimer, 0);
+    }
+}
+
+// ---------------- Hilos: escena y render ----------------
+// Los callbacks de GLUT solo encolan comandos. El hilo de escena es el
+// unico que toca shapes, las pilas, el indice y el diario; despues de cada
+// tanda publica una copia inmutable. El hilo de render rasteriza la
+// ultima copia y GLUT la dibuja cuando esta lista.
+enum CommandType {
+    CMD_ADD,
+    CMD_CLEAR,
+    CMD_UNDO,
+    CMD_REDO,
+    CMD_SELECT,
+    CMD_BATCH
+};
+
+struct ServerConn;
+
+struct Command {
+    CommandType type;
+    Shape shape;              // CMD_ADD
+    int x, y;                 // CMD_SELECT
+    vector<char> visible;     // CMD_SELECT: capas visibles
+    shared_ptr<vector<Shape>> batch;   // CMD_BATCH
+    int errors;                        // CMD_BATCH: lineas rechazadas
+    shared_ptr<ServerConn> conn;       // CMD_BATCH: a quien confirmar
+};
+
+// Cola acotada sin locks para varios productores (Vyukov)
+template <class T>
+struct CommandQueue {
+    struct Cell {
+        atomic<size_t> seq;
+        T data;
+    };
+
+    size_t mask;
+    unique_ptr<Cell[]> cells;
+    atomic<size_t> head{0}, tail{0};
+
+    explicit CommandQueue(size_t n) : mask(n - 1), cells(new Cell[n]) {
+        for (size_t i = 0; i < n; i++) cells[i].seq.store(i, memory_order_relaxed);
+    }
+
+    bool push(const T &v) {
+        size_t pos = tail.load(memory_order_relaxed);
+        Cell *c;
+        for (;;) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(memory_order_acquire);
+            long long dif = (long long) seq - (long long) pos;
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            }
+            else if (dif < 0) return false;
+            else pos = tail.load(memory_order_relaxed);
+        }
+        c->data = v;
+        c->seq.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T &v) {
+        size_t pos = head.load(memory_order_relaxed);
+        Cell *c;
+        for (;;) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(memory_order_acquire);
+            long long dif = (long long) seq - (long long) (pos + 1);
+            if (dif == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
             }
+            else if (dif < 0) return false;
+            else pos = head.load(memory_order_relaxed);
         }
+        v = move(c->data);
+        c->seq.store(pos + mask + 1, memory_order_release);
+        return true;
     }
+};
+
+CommandQueue<Command> commands(1 << 12);
+atomic<bool> pipelineRunning(false);
+thread sceneThread, renderThread;
+
+// Solo para dormir a los hilos cuando no hay trabajo
+mutex sceneWakeLock, renderWakeLock;
+condition_variable sceneWake, renderWake;
+atomic<unsigned long> sceneVersion(0);
+atomic<unsigned int> frameReasons(0);
+
+// Para esperar a que los hilos terminen lo pendiente (reproduccion)
+atomic<unsigned long> commandsPosted(0), commandsApplied(0);
+atomic<unsigned long> renderedVersion(0);
 
-    glEnd();
+void postCommand(const Command &c) {
+    commandsPosted++;
+    while (!commands.push(c)) this_thread::yield();
+    sceneWake.notify_one();
 }
 
-// Linea DDA
-void lineDDA(int x0, int y0, int x1, int y1, int t) {
-    int dx = x1 - x0;
-    int dy = y1 - y0;
-    int steps = max(abs(dx), abs(dy));
+void postSimple(CommandType t) {
+    Command c;
+    c.type = t;
+    postCommand(c);
+}
 
-    float x = x0;
-    float y = y0;
-    float incx = dx / (float) steps;
-    float incy = dy / (float) steps;
+void ackBatch(const Command &c);
 
-    glPointSize(t);
-    glBegin(GL_POINTS);
+// Aplica un comando en el hilo de escena; devuelve los motivos de redibujo
+unsigned int applyCommand(const Command &c) {
+    switch (c.type) {
+        case CMD_ADD: addShape(c.shape); return R_SCENE;
+        case CMD_CLEAR: clearShapes(); return R_SCENE;
+        case CMD_UNDO: return doUndo() ? R_SCENE : 0;
+        case CMD_REDO: return doRedo() ? R_SCENE : 0;
+        case CMD_SELECT: {
+            int i = shapeIndex.nearest(shapes, c.x, c.y, 8, c.visible);
+            unsigned int id = i >= 0 ? shapes[i].id : 0;
+            if (id == selectedId) return 0;
+            selectedId = id;
+            selectedIndex = i >= 0 ? i : 0;
+            if (i >= 0) {
+                cout << "Seleccionada figura " << i << " (tipo " << shapes[i].type
+                     << ", grosor " << shapes[i].thickness << ")" << endl;
+            }
+            return R_SELECTION;
+        }
+        case CMD_BATCH: {
+            addShapes(*c.batch);
+            ackBatch(c);
+            return c.batch->empty() ? 0 : R_SCENE;
+        }
+    }
+    return 0;
+}
 
-    for (int i = 0; i <= steps; i++) {
-        putPixel(roundi(x), roundi(y));
-        x += incx;
-        y += incy;
+void publishScene() {
+    auto snap = make_shared<SceneSnapshot>();
+    snap->shapes = shapes;
+    snap->selectedId = selectedId;
+    snap->selectedIndex = selectedIndex;
+    snap->maxLayer = maxShapeLayer;
+    atomic_store(&latestScene, shared_ptr<const SceneSnapshot>(snap));
+    sceneVersion++;
+    renderWake.notify_one();
+}
+
+void sceneLoop() {
+    auto lastSync = chrono::steady_clock::now();
+    while (pipelineRunning) {
+        Command c;
+        unsigned int r = 0;
+        unsigned long n = 0;
+        while (commands.pop(c)) {
+            r |= applyCommand(c);
+            n++;
+        }
+        if (r) {
+            frameReasons |= r;
+            publishScene();
+        }
+        commandsApplied += n;
+
+        if (msSince(lastSync) >= 1000) {
+            journalTick();
+            lastSync = chrono::steady_clock::now();
+        }
+        if (!n) {
+            unique_lock<mutex> lk(sceneWakeLock);
+            sceneWake.wait_for(lk, chrono::milliseconds(5));
+        }
     }
 
-    glEnd();
+    // Al cerrar se aplican los comandos que quedaron en la cola, asi lo
+    // dibujado justo antes de salir llega al diario. Los productores ya
+    // pararon: pipelineStop se llama desde el hilo de GLUT y el servidor
+    // se detiene antes.
+    Command c;
+    unsigned long n = 0;
+    unsigned int r = 0;
+    while (commands.pop(c)) {
+        r |= applyCommand(c);
+        n++;
+    }
+    if (r) publishScene();
+    commandsApplied += n;
 }
 
-// Circulo Punto Medio
-void circ8(int xc, int yc, int x, int y) {
-    putPixel(xc + x, yc + y);
-    putPixel(xc - x, yc + y);
-    putPixel(xc + x, yc - y);
-    putPixel(xc - x, yc - y);
-    putPixel(xc + y, yc + x);
-    putPixel(xc - y, yc + x);
-    putPixel(xc + y, yc - x);
-    putPixel(xc - y, yc - x);
+ShapeRasterPtr rasterizeForFrame(const Shape &s) {
+    return make_shared<ShapeRaster>(ShapeRaster{s.color, shapeSpans(s), s.offsets});
 }
 
-void circlePM(int xc, int yc, int r, int t) {
-    int x = 0;
-    int y = r;
-    int p = 1 - r;
+// Rasteriza la ultima escena. Cada figura se rasteriza una sola vez (por
+// id) y una capa solo se arma de nuevo si cambio su lista de figuras.
+void renderLoop() {
+    unordered_map<unsigned int, ShapeRasterPtr> byId;
+    vector<vector<unsigned int>> layerIds;
+    vector<shared_ptr<const LayerRaster>> layerRasters;
+    unsigned long done = 0;
 
-    glPointSize(t);
-    glBegin(GL_POINTS);
+    while (pipelineRunning) {
+        unsigned long v = sceneVersion;
+        if (v == done) {
+            unique_lock<mutex> lk(renderWakeLock);
+            renderWake.wait_for(lk, chrono::milliseconds(5));
+            continue;
+        }
+        done = v;
+        shared_ptr<const SceneSnapshot> scene = atomic_load(&latestScene);
 
-    circ8(xc, yc, x, y);
+        vector<vector<unsigned int>> ids;
+        for (auto &s : scene->shapes) {
+            if (s.layer >= (int) ids.size()) ids.resize(s.layer + 1);
+            ids[s.layer].push_back(s.id);
+        }
+        layerIds.resize(max(layerIds.size(), ids.size()));
+        layerRasters.resize(layerIds.size());
+        ids.resize(layerIds.size());
 
-    while (x < y) {
-        x++;
-        if (p < 0) {
-            p += 2 * x + 1;
+        unordered_map<unsigned int, ShapeRasterPtr> live;
+        for (auto &s : scene->shapes) {
+            auto it = byId.find(s.id);
+            live[s.id] = it != byId.end() ? it->second : rasterizeForFrame(s);
         }
-        else {
-            y--;
-            p += 2 * (x - y) + 1;
+        byId.swap(live);
+
+        for (size_t li = 0; li < ids.size(); li++) {
+            if (ids[li] == layerIds[li] && (layerRasters[li] || ids[li].empty())) continue;
+            auto lr = make_shared<LayerRaster>();
+            for (unsigned int id : ids[li]) lr->shapes.push_back(byId[id]);
+            layerRasters[li] = lr;
+            layerIds[li].swap(ids[li]);
         }
-        circ8(xc, yc, x, y);
+
+        auto frame = make_shared<RenderedFrame>();
+        frame->scene = scene;
+        frame->layers = layerRasters;
+        atomic_store(&latestFrame, shared_ptr<const RenderedFrame>(frame));
+        renderedVersion = v;
+        frameReasons |= R_SCENE;
+    }
+}
+
+// Espera a que se apliquen los comandos encolados y se rasterice la escena
+// resultante
+void pipelineSync() {
+    while (pipelineRunning &&
+           (commandsApplied != commandsPosted || renderedVersion != sceneVersion)) {
+        this_thread::yield();
     }
+}
 
-    glEnd();
+// Revisa desde el hilo de GLUT si hay un frame nuevo que dibujar
+void pipelineTimer(int) {
+    unsigned int r = frameReasons.exchange(0);
+
+    // Las capas solo se crean en este hilo
+    int top = atomic_load(&latestScene)->maxLayer;
+    if (top >= (int) layers.size()) {
+        ensureLayer(top);
+        r |= R_LAYERS;
+    }
+    if (r) invalidate(r);
+    glutTimerFunc(4, pipelineTimer, 0);
 }
 
-// Elipse Punto Medio
-void ellipse4(int xc, int yc, int x, int y) {
-    putPixel(xc + x, yc + y);
-    putPixel(xc - x, yc + y);
-    putPixel(xc + x, yc - y);
-    putPixel(xc - x, yc - y);
+void pipelineStart() {
+    publishScene();
+    pipelineRunning = true;
+    sceneThread = thread(sceneLoop);
+    renderThread = thread(renderLoop);
 }
 
-void ellipsePM(int xc, int yc, int rx, int ry, int t) {
-    int x = 0;
-    int y = ry;
+void pipelineStop() {
+    if (!pipelineRunning) return;
+    pipelineRunning = false;
+    sceneWake.notify_one();
+    renderWake.notify_one();
+    sceneThread.join();
+    renderThread.join();
+}
 
-    long rx2 = rx * rx;
-    long ry2 = ry * ry;
-    long two_rx2 = 2 * rx2;
-    long two_ry2 = 2 * ry2;
+// ---------------- Servidor de comandos ----------------
+// Con --serve ruta se escuchan comandos de dibujo por un socket Unix, una
+// linea por figura:
+//   line x1 y1 x2 y2 | dda x1 y1 x2 y2 | ddafix x1 y1 x2 y2 | circle xc yc r
+//   ellipse xc yc rx ry | bezier x1 y1 cx1 cy1 cx2 cy2 x2 y2
+//   color r g b (0-255) | thick n | layer n   (valen para las siguientes)
+//   array nx ny sx sy | ring n r   (repiten las siguientes; array 1 1 0 0
+//   vuelve a una sola copia)
+// Todo lo que llega en una lectura forma un lote: se agrega a la escena en
+// un paso (una entrada de deshacer y un redibujo) y el hilo de escena
+// responde "ok figuras errores" cuando lo aplico.
+// Las coordenadas se recortan a SERVER_COORD alrededor del origen y los
+// radios a MAX_CANVAS; un color fuera de 0-255, un numero mal escrito o
+// que no entra en 64 bits o una linea de mas de SERVER_MAX_LINE bytes es
+// un error.
+const long long SERVER_COORD = 2LL * MAX_CANVAS;
+const size_t SERVER_MAX_LINE = 1024;
 
-    double p1 = ry2 - rx2 * ry + 0.25 * rx2;
+struct ServerConn {
+    int fd;
+    string pending;       // linea incompleta de la lectura anterior
+    bool skipping = false;   // descartando el resto de una linea demasiado larga
+    Color color = {0, 0, 0};
+    int thickness = 1;
+    int layer = 0;
+    Offsets offsets;
 
-    glPointSize(t);
-    glBegin(GL_POINTS);
+#ifndef _WIN32
+    ~ServerConn() { close(fd); }
+#endif
+};
 
-    while ((two_ry2 * x) <= (two_rx2 * y)) {
-        ellipse4(xc, yc, x, y);
-        if (p1 < 0) {
-            x++;
-            p1 += two_ry2 * x + ry2;
-        }
-        else {
-            x++;
-            y--;
-            p1 += two_ry2 * x - two_rx2 * y + ry2;
-        }
-    }
+void ackBatch(const Command &c) {
+#ifndef _WIN32
+    char msg[64];
+    int n = snprintf(msg, sizeof msg, "ok %zu %d\n", c.batch->size(), c.errors);
+    // Si el cliente no lee sus confirmaciones se descartan
+    send(c.conn->fd, msg, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
 
-    double p2 = ry2 * (x + 0.5) * (x + 0.5)
-               + rx2 * (y - 1) * (y - 1)
-               - rx2 * ry2;
+#ifndef _WIN32
+string serverPath;
+int serverFd = -1;
+atomic<bool> serverRunning(false);
+thread serverThread;
+atomic<unsigned long> serverShapes(0), serverBatches(0);
 
-    while (y >= 0) {
-        ellipse4(xc, yc, x, y);
-        if (p2 > 0) {
-            y--;
-            p2 -= two_rx2 * y + rx2;
-        }
-        else {
-            y--;
-            x++;
-            p2 += two_ry2 * x - two_rx2 * y + rx2;
+// Interpreta una linea; false si no es un comando valido
+bool parseDrawLine(ServerConn &cn, const string &line, vector<Shape> &out) {
+    char cmd[16];
+    int used;
+    if (sscanf(line.c_str(), "%15s%n", cmd, &used) != 1) return line.find_first_not_of(" \t\r") == string::npos;
+
+    // Hasta 8 enteros; uno mal escrito o fuera de long long invalida la linea
+    long long v[8];
+    int n = 0;
+    const char *p = line.c_str() + used;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+        if (!*p) break;
+        char *end;
+        errno = 0;
+        long long x = strtoll(p, &end, 10);
+        if (n == 8 || end == p || errno == ERANGE || (*end && !strchr(" \t\r", *end))) return false;
+        v[n++] = x;
+        p = end;
+    }
+    auto bounded = [&](int k) { return v[k] >= -SERVER_COORD && v[k] <= SERVER_COORD; };
+    string c = cmd;
+    auto coord = [&](int k) { return (int) max(-SERVER_COORD, min(SERVER_COORD, v[k])); };
+    auto radius = [&](int k) { return (int) min((long long) MAX_CANVAS, v[k]); };
+
+    if (c == "color" && n == 3) {
+        for (int k = 0; k < 3; k++) {
+            if (v[k] < 0 || v[k] > 255) return false;
         }
+        cn.color = {v[0] / 255.0f, v[1] / 255.0f, v[2] / 255.0f};
+        return true;
+    }
+    if (c == "thick" && n == 1 && v[0] >= 1 && v[0] <= 255) {
+        cn.thickness = v[0];
+        return true;
+    }
+    if (c == "layer" && n == 1 && v[0] >= 0 && v[0] < MAX_LAYERS) {
+        cn.layer = v[0];
+        return true;
+    }
+    if (c == "array" && n == 4 && v[0] >= 1 && v[1] >= 1 && v[0] <= MAX_COPIES && v[1] <= MAX_COPIES &&
+        v[0] * v[1] <= MAX_COPIES && bounded(2) && bounded(3) &&
+        (v[0] - 1) * llabs(v[2]) <= SERVER_COORD && (v[1] - 1) * llabs(v[3]) <= SERVER_COORD) {
+        cn.offsets = v[0] * v[1] > 1 ? gridOffsets((int) v[0], (int) v[1], (int) v[2], (int) v[3]) : NULL;
+        return true;
+    }
+    if (c == "ring" && n == 2 && v[0] >= 1 && v[0] <= MAX_COPIES && bounded(1)) {
+        cn.offsets = ringOffsets((int) v[0], (int) v[1]);
+        return true;
     }
 
-    glEnd();
+    Shape sh{};
+    sh.color = cn.color;
+    sh.thickness = cn.thickness;
+    sh.layer = cn.layer;
+    sh.offsets = cn.offsets;
+    if ((c == "line" || c == "dda" || c == "ddafix") && n == 4) {
+        sh.type = c == "line" ? LINE_DIRECT : c == "dda" ? LINE_DDA : LINE_DDA_FIXED;
+        sh.x1 = coord(0); sh.y1 = coord(1); sh.x2 = coord(2); sh.y2 = coord(3);
+    }
+    else if (c == "circle" && n == 3 && v[2] >= 0) {
+        sh.type = CIRCLE_PM;
+        sh.xc = coord(0); sh.yc = coord(1); sh.r = radius(2);
+    }
+    else if (c == "ellipse" && n == 4 && v[2] >= 0 && v[3] >= 0) {
+        sh.type = ELLIPSE_PM;
+        sh.xc = coord(0); sh.yc = coord(1); sh.rx = radius(2); sh.ry = radius(3);
+    }
+    else if (c == "bezier" && n == 8) {
+        sh.type = BEZIER_AFD;
+        sh.x1 = coord(0); sh.y1 = coord(1); sh.cx1 = coord(2); sh.cy1 = coord(3);
+        sh.cx2 = coord(4); sh.cy2 = coord(5); sh.x2 = coord(6); sh.y2 = coord(7);
+    }
+    else {
+        return false;
+    }
+    out.push_back(sh);
+    return true;
 }
 
-// ---------------- Dibujo ----------------
-void drawShape(const Shape &s) {
-    glColor3f(s.color.r, s.color.g, s.color.b);
+// Lee lo disponible en la conexion y lo encola como un lote; false si se
+// cerro
+bool serverRead(const shared_ptr<ServerConn> &cn) {
+    char buf[1 << 16];
+    ssize_t got = recv(cn->fd, buf, sizeof buf, 0);
+    if (got <= 0) return false;
 
-    if (s.type == LINE_DIRECT) {
-        lineDirect(s.x1, s.y1, s.x2, s.y2, s.thickness);
-    }
-    else if (s.type == LINE_DDA) {
-        lineDDA(s.x1, s.y1, s.x2, s.y2, s.thickness);
-    }
-    else if (s.type == CIRCLE_PM) {
-        circlePM(s.xc, s.yc, s.r, s.thickness);
+    cn->pending.append(buf, got);
+    auto batch = make_shared<vector<Shape>>();
+    int errors = 0;
+    size_t start = 0, end;
+    while ((end = cn->pending.find('\n', start)) != string::npos) {
+        if (cn->skipping) cn->skipping = false;   // ya se conto como error
+        else if (end - start > SERVER_MAX_LINE ||
+                 !parseDrawLine(*cn, cn->pending.substr(start, end - start), *batch)) errors++;
+        start = end + 1;
     }
-    else if (s.type == ELLIPSE_PM) {
-        ellipsePM(s.xc, s.yc, s.rx, s.ry, s.thickness);
+    cn->pending.erase(0, start);
+
+    // Un cliente que nunca manda el fin de linea no hace crecer el buffer
+    if (cn->pending.size() > SERVER_MAX_LINE) {
+        if (!cn->skipping) errors++;
+        cn->skipping = true;
+        cn->pending.clear();
     }
+    if (batch->empty() && !errors) return true;
+
+    Command c;
+    c.type = CMD_BATCH;
+    c.batch = batch;
+    c.errors = errors;
+    c.conn = cn;
+    postCommand(c);
+    serverShapes += batch->size();
+    serverBatches++;
+    return true;
 }
 
-void redrawAll() {
-    glClear(GL_COLOR_BUFFER_BIT);
+void serverLoop() {
+    vector<shared_ptr<ServerConn>> conns;
+    while (serverRunning) {
+        vector<pollfd> fds;
+        fds.push_back({serverFd, POLLIN, 0});
+        for (auto &cn : conns) fds.push_back({cn->fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 100) <= 0) continue;
 
-    // Dibujar grid
-    if (showGrid) {
-        glColor3f(0.85, 0.85, 0.85);
-        glBegin(GL_LINES);
-        for (int x = 0; x <= viewportW; x += 20) {
-            glVertex2i(x, 0);
-            glVertex2i(x, viewportH);
+        for (size_t i = fds.size() - 1; i >= 1; i--) {
+            if (fds[i].revents && !serverRead(conns[i - 1])) conns.erase(conns.begin() + (i - 1));
         }
-        for (int y = 0; y <= viewportH; y += 20) {
-            glVertex2i(0, y);
-            glVertex2i(viewportW, y);
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(serverFd, NULL, NULL);
+            if (fd >= 0) {
+                auto cn = make_shared<ServerConn>();
+                cn->fd = fd;
+                conns.push_back(cn);
+            }
         }
-        glEnd();
     }
+}
 
-    // Dibujar ejes
-    if (showAxes) {
-        glColor3f(0.6, 0.6, 0.6);
-        glBegin(GL_LINES);
-        glVertex2i(0, viewportH / 2);
-        glVertex2i(viewportW, viewportH / 2);
-        glVertex2i(viewportW / 2, 0);
-        glVertex2i(viewportW / 2, viewportH);
-        glEnd();
+bool serverStart(const string &path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        cout << "Ruta de socket demasiado larga: " << path << endl;
+        return false;
     }
+    strcpy(addr.sun_path, path.c_str());
 
-    // Dibujar figuras guardadas
-    for (auto &s : shapes) {
-        drawShape(s);
+    serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (serverFd < 0 || bind(serverFd, (sockaddr*) &addr, sizeof addr) < 0 || listen(serverFd, 16) < 0) {
+        cout << "No se pudo escuchar en " << path << endl;
+        if (serverFd >= 0) close(serverFd);
+        serverFd = -1;
+        return false;
     }
-
-    glutSwapBuffers();
+    serverPath = path;
+    serverRunning = true;
+    serverThread = thread(serverLoop);
+    cout << "Esperando comandos en " << path << endl;
+    return true;
 }
 
-// Guardar imagen en formato PPM
-void exportPPM(const string &filename) {
-    int w = viewportW;
-    int h = viewportH;
+void serverStop() {
+    if (!serverRunning) return;
+    serverRunning = false;
+    serverThread.join();
+    close(serverFd);
+    unlink(serverPath.c_str());
+}
+#endif
 
-    vector<unsigned char> pixels(3 * w * h);
-    glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+// Estadisticas de memoria del renderer
+void printStats() {
+    cout << "Pool: " << poolAllocCount << " reservas, "
+         << poolAllocBytes / 1024 << " KB reservados, "
+         << framePool.points.size() << " buffers de puntos, "
+         << framePool.scratch.size() / 1024 << " KB de lectura, "
+         << layerRebuilds << " listas de capa rearmadas" << endl;
+#ifdef CAD_ALLOC_CHECK
+    cout << "new en el hilo de la ventana: " << threadAllocCount << " reservas" << endl;
+#endif
 
-    ofstream ofs(filename, ios::binary);
-    ofs << "P6\n" << w << " " << h << "\n255\n";
-    for (int y = h - 1; y >= 0; y--) {
-        ofs.write((char*)&pixels[y * w * 3], 3 * w);
+    // Los contadores del cache cambian en los hilos de render y cobertura
+    size_t hits, misses, evictions, tables, spans, pixels;
+    {
+        lock_guard<mutex> g(rasterCache.lock);
+        hits = rasterCache.hits;
+        misses = rasterCache.misses;
+        evictions = rasterCache.evictions;
+        tables = rasterCache.lru.size();
+        spans = rasterCache.spans;
+        pixels = rasterCache.pixels;
     }
-    ofs.close();
+    cout << "Cache de circulos/elipses: " << hits << " aciertos, "
+         << misses << " fallos, " << evictions << " descartes, "
+         << tables << " tablas, " << spans << " tramos ("
+         << spans * sizeof(Span) / 1024 << " KB) para " << pixels
+         << " pixeles (" << pixels * sizeof(Point) / 1024 << " KB como puntos)" << endl;
+    cout << "Redibujado: " << sched.requests << " pedidos, " << sched.frames << " frames, "
+         << sched.missed << " fuera de presupuesto (peor " << sched.worstMs << " ms)" << endl;
+}
+
+// ---------------- Grabacion de sesiones ----------------
+// Con --record archivo cada evento de GLUT se guarda como una linea de
+// texto con los ms desde el inicio; --replay lo vuelve a ejecutar contra
+// los mismos manejadores (ver mas abajo).
+//   CADREC 1 ventanaW ventanaH lienzoW lienzoH fijo
+//   ms M boton estado x y | ms K tecla x y | ms S tecla x y | ms U op | ms R w h
+ofstream recordFile;
+bool recording = false;
+chrono::steady_clock::time_point recordStart;
 
-    cout << "Exportado " << filename << endl;
+void recordEvent(char kind, int a, int b = 0, int c = 0, int d = 0) {
+    if (!recording) return;
+    recordFile << (long long) msSince(recordStart) << ' ' << kind << ' ' << a;
+    if (kind == 'M') recordFile << ' ' << b << ' ' << c << ' ' << d;
+    else if (kind == 'K' || kind == 'S') recordFile << ' ' << b << ' ' << c;
+    else if (kind == 'R') recordFile << ' ' << b;
+    recordFile << endl;
+}
+
+bool startRecording(const string &filename) {
+    recordFile.open(filename);
+    if (!recordFile) {
+        cout << "No se pudo abrir " << filename << endl;
+        return false;
+    }
+    recordFile << "CADREC 1 " << WINW << ' ' << WINH << ' ' << canvasW << ' ' << canvasH
+               << ' ' << canvasFixed << endl;
+    recording = true;
+    recordStart = chrono::steady_clock::now();
+    cout << "Grabando eventos en " << filename << endl;
+    return true;
 }
 
 // ---------------- Acciones ----------------
+// Tambien llega aqui sin pedidos cuando GLUT necesita repintar la ventana
+// El tiempo del frame no incluye el intercambio de buffers: con vsync
+// glutSwapBuffers espera el refresco y no es trabajo del programa
 void display() {
+    auto t0 = chrono::steady_clock::now();
     redrawAll();
+    double ms = msSince(t0);
+    glutSwapBuffers();
+
+    sched.frames++;
+    sched.worstMs = max(sched.worstMs, ms);
+    if (ms > FRAME_MS) {
+        sched.missed++;
+        cout << "Frame fuera de presupuesto: " << ms << " ms (" << reasonNames(sched.reasons) << ")" << endl;
+    }
+
+    sched.reasons = 0;
+    sched.lastFrame = chrono::steady_clock::now();
+}
+
+// Mantiene la vista dentro del lienzo
+void clampView() {
+    viewX = max(0, min(viewX, canvasW - viewportW));
+    viewY = max(0, min(viewY, canvasH - viewportH));
 }
 
 void reshape(int w, int h) {
+    recordEvent('R', w, h);
     viewportW = w;
     viewportH = h;
+    if (!canvasFixed) {
+        canvasW = w;
+        canvasH = h;
+    }
+    clampView();
 
     glViewport(0, 0, w, h);
     glMatrixMode(GL_PROJECTION);
@@ -330,24 +4317,80 @@ void reshape(int w, int h) {
     glLoadIdentity();
 }
 
+void postAdd(const Shape &sh) {
+    Command c;
+    c.type = CMD_ADD;
+    c.shape = sh;
+    // El relleno sale del framebuffer, no se repite
+    if (sh.type != FILL_SCAN) c.shape.offsets = currentRepeat;
+    postCommand(c);
+}
+
 void mouse(int b, int s, int x, int y) {
-    int ox = x;
-    int oy = viewportH - y;
+    recordEvent('M', b, s, x, y);
+    int ox = x + viewX;
+    int oy = viewportH - y + viewY;
 
     if (b == GLUT_LEFT_BUTTON && s == GLUT_DOWN) {
-        if (!waitingSecondPoint) {
+        if (currentTool == SELECT) {
+            Command c;
+            c.type = CMD_SELECT;
+            c.x = ox;
+            c.y = oy;
+            for (auto &L : layers) c.visible.push_back(L.visible);
+            postCommand(c);
+        }
+        else if (currentTool == FILL_SCAN) {
+            Shape sh{};
+            sh.type = FILL_SCAN;
+            sh.x1 = ox;
+            sh.y1 = oy;
+            sh.color = currentColor;
+            sh.thickness = 1;
+            sh.layer = currentLayer;
+            sh.spans = computeFill(ox, oy, currentColor);
+
+            postAdd(sh);
+            waitingSecondPoint = false;
+        }
+        else if (currentTool == BEZIER_AFD) {
+            // Clics: inicio, control 1, control 2, fin
+            if (bezierCount < 3) {
+                bezierX[bezierCount] = ox;
+                bezierY[bezierCount] = oy;
+                bezierCount++;
+                return;
+            }
+
+            Shape sh{};
+            sh.type = BEZIER_AFD;
+            sh.x1 = bezierX[0];
+            sh.y1 = bezierY[0];
+            sh.cx1 = bezierX[1];
+            sh.cy1 = bezierY[1];
+            sh.cx2 = bezierX[2];
+            sh.cy2 = bezierY[2];
+            sh.x2 = ox;
+            sh.y2 = oy;
+            sh.color = currentColor;
+            sh.thickness = currentThickness;
+            sh.layer = currentLayer;
+
+            postAdd(sh);
+            bezierCount = 0;
+        }
+        else if (!waitingSecondPoint) {
             firstX = ox;
             firstY = oy;
             waitingSecondPoint = true;
         }
         else {
-            pushUndo();
-
-            Shape sh;
+            Shape sh{};
             sh.color = currentColor;
             sh.thickness = currentThickness;
+            sh.layer = currentLayer;
 
-            if (currentTool == LINE_DIRECT || currentTool == LINE_DDA) {
+            if (isLine(currentTool)) {
                 sh.type = currentTool;
                 sh.x1 = firstX;
                 sh.y1 = firstY;
@@ -370,32 +4413,125 @@ void mouse(int b, int s, int x, int y) {
                 sh.ry = abs(oy - firstY);
             }
 
-            shapes.push_back(sh);
+            postAdd(sh);
             waitingSecondPoint = false;
-            glutPostRedisplay();
         }
     }
 }
 
-void keyboard(unsigned char k, int, int) {
-    if (k == 'g' || k == 'G') { showGrid = !showGrid; }
-    if (k == 'e' || k == 'E') { showAxes = !showAxes; }
-    if (k == 'c' || k == 'C') { pushUndo(); shapes.clear(); }
-    if (k == 'z' || k == 'Z') doUndo();
-    if (k == 'y' || k == 'Y') doRedo();
-    if (k == 'p' || k == 'P' || k == 's' || k == 'S') exportPPM("canvas.ppm");
+// ---------------- Capas ----------------
+void showLayerTitle() {
+    string t = "Mini CAD Raster - " + layers[currentLayer].name;
+    if (!layers[currentLayer].visible) t += " (oculta)";
+    glutSetWindowTitle(t.c_str());
+}
+
+void newLayer() {
+    if ((int) layers.size() >= MAX_LAYERS) {
+        cout << "No se pueden crear mas de " << MAX_LAYERS << " capas" << endl;
+        return;
+    }
+    ensureLayer((int) layers.size());
+    currentLayer = (int) layers.size() - 1;
+}
+
+// Mueve la capa activa dir posiciones en el orden de composicion
+void moveLayer(int dir) {
+    auto it = find(layerOrder.begin(), layerOrder.end(), currentLayer);
+    int pos = (int) (it - layerOrder.begin());
+    int to = pos + dir;
+    if (to < 0 || to >= (int) layerOrder.size()) return;
+    swap(layerOrder[pos], layerOrder[to]);
+}
+
+thread coverageThread;
+atomic<bool> coverageRunning(false);
+
+// Estadisticas de la escena publicada, solo capas visibles. Se calculan
+// en un hilo aparte con una copia de lo que necesitan, asi la ventana
+// sigue respondiendo.
+void showCoverage() {
+    if (coverageRunning) {
+        cout << "La cobertura ya se esta calculando" << endl;
+        return;
+    }
+    if (coverageThread.joinable()) coverageThread.join();
+
+    shared_ptr<const SceneSnapshot> scene = atomic_load(&latestScene);
+    vector<char> visible(layers.size());
+    for (size_t i = 0; i < layers.size(); i++) visible[i] = layers[i].visible;
+    int w = canvasW, h = canvasH;
+    coverageRunning = true;
+    coverageThread = thread([scene, visible = move(visible), w, h]() {
+        writeCoverage("cobertura.txt", scene->shapes, visible, w, h);
+        coverageRunning = false;
+    });
+}
+
+void coverageStop() {
+    if (coverageThread.joinable()) coverageThread.join();
+}
+
+void keyboard(unsigned char k, int x, int y) {
+    recordEvent('K', k, x, y);
+    unsigned int r = 0;
+
+    if (k == 'g' || k == 'G') { showGrid = !showGrid; r |= R_VIEW; }
+    if (k == 'e' || k == 'E') { showAxes = !showAxes; r |= R_VIEW; }
+    if (k == 'c' || k == 'C') postSimple(CMD_CLEAR);
+    if (k == 'z' || k == 'Z') postSimple(CMD_UNDO);
+    if (k == 'y' || k == 'Y') postSimple(CMD_REDO);
+    if (k == 'p' || k == 'P' || k == 's' || k == 'S') exportWindow("canvas.ppm");
+    if (k == 'l' || k == 'L') exportCanvas("lienzo.ppm");
+    if (k == 'q' || k == 'Q') exportCanvas("lienzo.qoi");
+    if (k == 'b' || k == 'B') exportCanvas("lienzo.bmp");
+    if (k == 'i' || k == 'I') printStats();
+    if (k == 'o' || k == 'O') showCoverage();
+    if (k == 'k' || k == 'K') { toggleCompare(); r |= R_VIEW; }
+    if (k == 'm' || k == 'M') {
+        bool on = !parallelArcs;
+        parallelArcs = on;
+        cout << "Circulos grandes en paralelo: " << (on ? "si" : "no") << endl;
+    }
+    if (k >= '1' && k <= '9' && k - '1' < (int) layers.size()) { currentLayer = k - '1'; r |= R_LAYERS; }
+    if (k == 'n' || k == 'N') { newLayer(); r |= R_LAYERS; }
+    if (k == 'v' || k == 'V') { layers[currentLayer].visible = !layers[currentLayer].visible; r |= R_LAYERS; }
+    if (k == '+') { moveLayer(1); r |= R_LAYERS; }
+    if (k == '-') { moveLayer(-1); r |= R_LAYERS; }
     if (k == 27) exit(0);
 
-    glutPostRedisplay();
+    if (r & R_LAYERS) showLayerTitle();
+    invalidate(r);
+}
+
+// Flechas: desplazan la vista sobre el lienzo
+void special(int k, int x, int y) {
+    recordEvent('S', k, x, y);
+    if (k == GLUT_KEY_LEFT) viewX -= viewportW / 4;
+    if (k == GLUT_KEY_RIGHT) viewX += viewportW / 4;
+    if (k == GLUT_KEY_DOWN) viewY -= viewportH / 4;
+    if (k == GLUT_KEY_UP) viewY += viewportH / 4;
+    if (k == GLUT_KEY_HOME) viewX = viewY = 0;
+
+    int px = viewX, py = viewY;
+    clampView();
+    if (k == GLUT_KEY_HOME || px != viewX || py != viewY) invalidate(R_VIEW);
 }
 
 // Menu contextual
 void menuSelect(int op) {
+    recordEvent('U', op);
+    unsigned int r = 0;
+
     switch (op) {
         case 1: currentTool = LINE_DIRECT; break;
         case 2: currentTool = LINE_DDA; break;
+        case 8: currentTool = LINE_DDA_FIXED; break;
         case 3: currentTool = CIRCLE_PM; break;
         case 4: currentTool = ELLIPSE_PM; break;
+        case 5: currentTool = FILL_SCAN; waitingSecondPoint = false; break;
+        case 6: currentTool = SELECT; waitingSecondPoint = false; break;
+        case 7: currentTool = BEZIER_AFD; bezierCount = 0; break;
 
         case 10: currentColor = {0,0,0}; break;
         case 11: currentColor = {1,0,0}; break;
@@ -407,24 +4543,46 @@ void menuSelect(int op) {
         case 22: currentThickness = 3; break;
         case 23: currentThickness = 5; break;
 
-        case 30: showGrid = !showGrid; break;
-        case 31: showAxes = !showAxes; break;
+        case 30: showGrid = !showGrid; r = R_VIEW; break;
+        case 31: showAxes = !showAxes; r = R_VIEW; break;
+
+        case 40: postSimple(CMD_CLEAR); break;
+        case 41: postSimple(CMD_UNDO); break;
+        case 42: postSimple(CMD_REDO); break;
+        case 43: exportWindow("canvas.ppm"); break;
+        case 44: exportCanvas("lienzo.ppm"); break;
+        case 45: exportWindow("canvas.qoi"); break;
+        case 46: exportCanvas("lienzo.qoi"); break;
+        case 47: toggleCompare(); r = R_VIEW; break;
+        case 48: exportCanvas("lienzo.bmp"); break;
+        case 49: showCoverage(); break;
 
-        case 40: pushUndo(); shapes.clear(); break;
-        case 41: doUndo(); break;
-        case 42: doRedo(); break;
-        case 43: exportPPM("canvas.ppm"); break;
+        case 50: newLayer(); r = R_LAYERS; break;
+        case 51: currentLayer = (currentLayer + 1) % layers.size(); r = R_LAYERS; break;
+        case 52: layers[currentLayer].visible = !layers[currentLayer].visible; r = R_LAYERS; break;
+        case 53: moveLayer(1); r = R_LAYERS; break;
+        case 54: moveLayer(-1); r = R_LAYERS; break;
+
+        case 60: currentRepeat = NULL; break;
+        case 61: currentRepeat = gridOffsets(4, 4, 40, 40); break;
+        case 62: currentRepeat = gridOffsets(1, 10, 0, 8); break;
+        case 63: currentRepeat = ringOffsets(8, 60); break;
     }
 
-    glutPostRedisplay();
+    if (r & R_LAYERS) showLayerTitle();
+    invalidate(r);
 }
 
 void createMenus() {
     int draw = glutCreateMenu(menuSelect);
     glutAddMenuEntry("Linea Directa", 1);
     glutAddMenuEntry("Linea DDA", 2);
+    glutAddMenuEntry("Linea DDA (punto fijo)", 8);
     glutAddMenuEntry("Circulo PM", 3);
     glutAddMenuEntry("Elipse PM", 4);
+    glutAddMenuEntry("Relleno (Cubeta)", 5);
+    glutAddMenuEntry("Bezier cubica", 7);
+    glutAddMenuEntry("Seleccionar", 6);
 
     int color = glutCreateMenu(menuSelect);
     glutAddMenuEntry("Negro", 10);
@@ -447,6 +4605,25 @@ void createMenus() {
     glutAddMenuEntry("Undo", 41);
     glutAddMenuEntry("Redo", 42);
     glutAddMenuEntry("Export PPM", 43);
+    glutAddMenuEntry("Export Lienzo PPM", 44);
+    glutAddMenuEntry("Export QOI", 45);
+    glutAddMenuEntry("Export Lienzo QOI", 46);
+    glutAddMenuEntry("Export Lienzo BMP (indexado)", 48);
+    glutAddMenuEntry("Comparar algoritmos", 47);
+    glutAddMenuEntry("Cobertura y solapes", 49);
+
+    int layerM = glutCreateMenu(menuSelect);
+    glutAddMenuEntry("Nueva capa", 50);
+    glutAddMenuEntry("Siguiente capa", 51);
+    glutAddMenuEntry("Mostrar/Ocultar capa", 52);
+    glutAddMenuEntry("Subir capa", 53);
+    glutAddMenuEntry("Bajar capa", 54);
+
+    int repeat = glutCreateMenu(menuSelect);
+    glutAddMenuEntry("Una copia", 60);
+    glutAddMenuEntry("Rejilla 4x4 (40 px)", 61);
+    glutAddMenuEntry("Rayado x10 (8 px)", 62);
+    glutAddMenuEntry("Circulo de 8 (radio 60)", 63);
 
     int mainM = glutCreateMenu(menuSelect);
     glutAddSubMenu("Dibujo", draw);
@@ -454,6 +4631,8 @@ void createMenus() {
     glutAddSubMenu("Grosor", thick);
     glutAddSubMenu("Vista", view);
     glutAddSubMenu("Herramientas", tools);
+    glutAddSubMenu("Capas", layerM);
+    glutAddSubMenu("Repeticion", repeat);
 
     glutAttachMenu(GLUT_RIGHT_BUTTON);
 }
@@ -462,24 +4641,288 @@ void createMenus() {
 void initGL() {
     glClearColor(1,1,1,1);
     glPointSize(1);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     gluOrtho2D(0, WINW, 0, WINH);
 }
 
+// ---------------- Reproduccion de sesiones ----------------
+// Alimenta los eventos grabados a los manejadores desde la funcion idle de
+// GLUT, lo mas rapido posible o respetando los tiempos (--realtime). Antes
+// de cada evento espera a que la escena y el render terminen lo anterior,
+// asi el resultado no depende de la velocidad de la maquina. Al final, con
+// un ESC grabado o con ESC en la ventana imprime un resumen de tiempos y
+// sale.
+struct RecEvent {
+    long long ms;
+    char kind;
+    int a, b, c, d;
+};
+
+struct ReplayStats {
+    int count = 0;
+    double handlerMs = 0;
+    double worstMs = 0;
+};
+
+vector<RecEvent> replayEvents;
+size_t replayPos = 0;
+bool replayRealtime = false;
+chrono::steady_clock::time_point replayStart;
+double replaySettleMs = 0;
+ReplayStats replayStats[5];   // M K S U R
+const char *replayKinds = "MKSUR";
+
+bool loadRecording(const string &filename) {
+    ifstream in(filename);
+    string magic;
+    int version, fixed;
+    int ww, wh;
+    if (!(in >> magic >> version >> ww >> wh >> canvasW >> canvasH >> fixed) ||
+        magic != "CADREC" || version != 1) {
+        cout << "Grabacion invalida: " << filename << endl;
+        return false;
+    }
+    canvasFixed = fixed != 0;
+
+    RecEvent e;
+    while (in >> e.ms >> e.kind >> e.a) {
+        e.b = e.c = e.d = 0;
+        if (e.kind == 'M') in >> e.b >> e.c >> e.d;
+        else if (e.kind == 'K' || e.kind == 'S') in >> e.b >> e.c;
+        else if (e.kind == 'R') in >> e.b;
+        replayEvents.push_back(e);
+    }
+    cout << "Reproduciendo " << replayEvents.size() << " eventos de " << filename << endl;
+    return true;
+}
+
+void replaySummary() {
+    double total = msSince(replayStart);
+    cout << "Reproduccion: " << replayPos << " de " << replayEvents.size() << " eventos en " << total << " ms ("
+         << (total > 0 ? replayPos * 1000.0 / total : 0) << " eventos/s)" << endl;
+    for (int i = 0; i < 5; i++) {
+        const ReplayStats &st = replayStats[i];
+        if (!st.count) continue;
+        cout << "  " << replayKinds[i] << ": " << st.count << " eventos, "
+             << st.handlerMs << " ms en manejadores (peor " << st.worstMs << " ms)" << endl;
+    }
+    cout << "  Espera de escena y render: " << replaySettleMs << " ms" << endl;
+    printStats();
+}
+
+// Espera lo pendiente, muestra el resumen y sale
+void replayFinish() {
+    auto t0 = chrono::steady_clock::now();
+    pipelineSync();
+    replaySettleMs += msSince(t0);
+    replaySummary();
+    exit(0);
+}
+
+// Unica entrada real durante la reproduccion: ESC la corta
+void replayKeyboard(unsigned char k, int, int) {
+    if (k == 27) {
+        cout << "Reproduccion interrumpida" << endl;
+        replayFinish();
+    }
+}
+
+void replayIdle() {
+    if (replayPos == replayEvents.size()) replayFinish();
+
+    const RecEvent &e = replayEvents[replayPos];
+    if (replayRealtime && msSince(replayStart) < e.ms) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        return;
+    }
+    replayPos++;
+
+    // El ESC con que se cerro la sesion grabada termina la reproduccion
+    if (e.kind == 'K' && e.a == 27) replayFinish();
+
+    auto t0 = chrono::steady_clock::now();
+    pipelineSync();
+    replaySettleMs += msSince(t0);
+
+    t0 = chrono::steady_clock::now();
+    switch (e.kind) {
+        case 'M': mouse(e.a, e.b, e.c, e.d); break;
+        case 'K': keyboard((unsigned char) e.a, e.b, e.c); break;
+        case 'S': special(e.a, e.b, e.c); break;
+        case 'U': menuSelect(e.a); break;
+        case 'R':
+            glutReshapeWindow(e.a, e.b);
+            reshape(e.a, e.b);
+            break;
+    }
+    double ms = msSince(t0);
+
+    const char *p = strchr(replayKinds, e.kind);
+    if (p && *p) {
+        ReplayStats &st = replayStats[p - replayKinds];
+        st.count++;
+        st.handlerMs += ms;
+        st.worstMs = max(st.worstMs, ms);
+    }
+}
+
 int main(int argc, char** argv) {
+    // La regresion, --generate-out y --stats no abren ventana
+    string goldenPath, genOutPath, statsPath;
+    bool goldenUpdate = false;
+    double goldenTolerance = 50;   // % de tiempo extra permitido
+    GenOptions gen;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        bool ok = true;
+        if (a == "--canvas" && i + 1 < argc) {
+            int w, h;
+            if (sscanf(argv[++i], "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+                canvasW = min(w, MAX_CANVAS);
+                canvasH = min(h, MAX_CANVAS);
+                canvasFixed = true;
+            }
+        }
+        else if (a == "--golden" && i + 1 < argc) goldenPath = argv[++i];
+        else if (a == "--golden-update") goldenUpdate = true;
+        else if (a == "--golden-tolerance" && i + 1 < argc) goldenTolerance = atof(argv[++i]);
+        else if (a == "--generate" && i + 1 < argc) gen.count = max(0LL, atoll(argv[++i]));
+        else if (a == "--generate-out" && i + 1 < argc) genOutPath = argv[++i];
+        else if (a == "--stats" && i + 1 < argc) statsPath = argv[++i];
+        else if (a == "--no-journal") journalEnabled = false;
+        else if (a == "--seed" && i + 1 < argc) gen.seed = strtoull(argv[++i], NULL, 10);
+        else if (a == "--mix" && i + 1 < argc) ok = parseMix(argv[++i], gen);
+        else if (a == "--sizes" && i + 1 < argc) ok = parseRange(argv[++i], gen.minSize, gen.maxSize);
+        else if (a == "--log-sizes") gen.logSizes = true;
+        else if (a == "--thick" && i + 1 < argc) {
+            ok = parseRange(argv[++i], gen.minThick, gen.maxThick) && gen.minThick >= 1 && gen.maxThick <= 255;
+        }
+        else if (a == "--colors" && i + 1 < argc) gen.colors = max(0, atoi(argv[++i]));
+        else if (a == "--layers" && i + 1 < argc) gen.layers = min(max(1, atoi(argv[++i])), MAX_LAYERS);
+        if (!ok) {
+            cout << "Opcion invalida: " << a << " " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (!goldenPath.empty()) return runGolden(goldenPath, goldenUpdate, goldenTolerance);
+    if (!genOutPath.empty()) {
+        auto t0 = chrono::steady_clock::now();
+        bool ok = writeGeneratedScene(gen, canvasW, canvasH, genOutPath);
+        cout << (ok ? "Escena escrita en " : "No se pudo escribir ") << genOutPath << " ("
+             << gen.count << " figuras, " << chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count()
+             << " ms)" << endl;
+        return ok ? 0 : 1;
+    }
+    if (!statsPath.empty()) {
+        // Sobre la escena generada o, sin --generate, la recuperada del diario
+        ShapeList v;
+        if (gen.count > 0) {
+            vector<Shape> g;
+            generateShapes(gen, canvasW, canvasH, g);
+            ensureLayer(gen.layers - 1);
+            for (auto &s : g) {
+                s.id = ++nextShapeId;
+                v.push_back(s);
+            }
+        }
+        else if (journalEnabled) {
+            // Solo lee: no escribe snapshot ni abre el diario
+            unsigned int snapGen, next;
+            long long n;
+            vector<const char *> partial;
+            if (!recoverScene(snapGen, next, n, partial)) return 1;
+            v = shapes;
+        }
+        return writeCoverage(statsPath, v, vector<char>(layers.size(), 1), canvasW, canvasH) ? 0 : 1;
+    }
+
     glutInit(&argc, argv);
+    string recordPath, replayPath, servePath;
+
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a == "--no-journal") {
+            journalEnabled = false;
+        }
+        else if (a == "--indexed") {
+            indexedCanvas = true;
+        }
+        else if (a == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
+        }
+        else if (a == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        }
+        else if (a == "--realtime") {
+            replayRealtime = true;
+        }
+        else if (a == "--serve" && i + 1 < argc) {
+            servePath = argv[++i];
+        }
+    }
+
+    // Grabar y reproducir parten de una escena vacia para que la sesion se
+    // pueda repetir; no se toca el diario del usuario
+    if (!replayPath.empty()) {
+        if (!loadRecording(replayPath)) return 1;
+        journalEnabled = false;
+    }
+    else if (!recordPath.empty()) {
+        if (!startRecording(recordPath)) return 1;
+        if (journalEnabled) cout << "Autosave desactivado durante la grabacion" << endl;
+        journalEnabled = false;
+    }
+
+    journalInit();
+    atexit(journalClose);
+    if (gen.count > 0) {
+        auto t0 = chrono::steady_clock::now();
+        vector<Shape> v;
+        generateShapes(gen, canvasW, canvasH, v);
+        ensureLayer(gen.layers - 1);
+        addShapes(v);
+        cout << "Generadas " << gen.count << " figuras en "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() << " ms" << endl;
+    }
+    pipelineStart();
+    atexit(pipelineStop);
+    atexit(coverageStop);
+
+    // El servidor se detiene antes que los hilos que consumen sus lotes
+    if (!servePath.empty()) {
+#ifndef _WIN32
+        if (serverStart(servePath)) atexit(serverStop);
+#else
+        cout << "--serve solo esta disponible con sockets Unix" << endl;
+#endif
+    }
+
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
     glutInitWindowSize(WINW, WINH);
     glutCreateWindow("Mini CAD Raster");
 
     initGL();
     createMenus();
+    showLayerTitle();
 
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
-    glutMouseFunc(mouse);
-    glutKeyboardFunc(keyboard);
+    glutTimerFunc(4, pipelineTimer, 0);
+
+    // Durante la reproduccion no se acepta entrada real, salvo ESC
+    if (!replayPath.empty()) {
+        glutDetachMenu(GLUT_RIGHT_BUTTON);
+        glutKeyboardFunc(replayKeyboard);
+        replayStart = chrono::steady_clock::now();
+        glutIdleFunc(replayIdle);
+    }
+    else {
+        glutMouseFunc(mouse);
+        glutKeyboardFunc(keyboard);
+        glutSpecialFunc(special);
+    }
 
     glutMainLoop();
     return 0;